@@ -11,12 +11,12 @@
 #ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/printk.h>
 #else
 #include <string.h>
 #endif
 
 #include "aesd-circular-buffer.h"
-#include <linux/printk.h>
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
@@ -10,14 +10,13 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/mutex.h>
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
 #endif
 
-#include <linux/mutex.h>
-
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -0,0 +1,554 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+static const aesd_log_ops_t *ops = NULL;
+
+// Held for reservations and commits, or for the whole append and
+// snapshot with backends that are not offset addressed
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static off_t reserved = 0;
+static off_t committed = 0;   // also read without the lock
+// told about every append once it is visible
+static void (*watcher)(void) = NULL;
+
+// ranges written ahead of an earlier write that is still running
+typedef struct commit_range_s commit_range_t;
+struct commit_range_s {
+  off_t off;
+  off_t end;
+};
+static commit_range_t *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_size = 0;
+
+// a line waiting for the committer, lives on the writer's stack
+typedef struct batch_item_s batch_item_t;
+struct batch_item_s {
+  const char *data;
+  size_t len;
+  int rc;
+  bool done;
+  batch_item_t *next;
+};
+
+typedef struct group_commit_s group_commit_t;
+struct group_commit_s {
+  bool enabled;
+  int max;
+  long delay_us;
+  pthread_t pid;
+  pthread_mutex_t lock;
+  pthread_cond_t more;      // committer waits for lines
+  pthread_cond_t flushed;   // writers wait for their line
+  batch_item_t *head;
+  batch_item_t **tail;
+  int count;
+  struct iovec *iov;
+};
+
+static group_commit_t batch = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .more = PTHREAD_COND_INITIALIZER,
+  .flushed = PTHREAD_COND_INITIALIZER,
+  .head = NULL,
+  .tail = &batch.head,
+};
+
+int aesd_log_init(const aesd_log_ops_t *backend, off_t resume)
+{
+  ops = backend;
+  reserved = resume;
+  committed = resume;
+  return (NULL != ops->open) ? ops->open(resume) : 0;
+}
+
+void aesd_log_cleanup(void)
+{
+  if (NULL != ops && NULL != ops->cleanup) ops->cleanup();
+}
+
+off_t aesd_log_seal(void)
+{
+  pthread_mutex_lock(&log_lock);
+  while (committed != reserved) pthread_cond_wait(&commit_cond, &log_lock);
+  // never unlocked, writers block here until the process exits
+  return (NULL != ops->write_at) ? committed : -1;
+}
+
+void aesd_log_watch(void (*notify)(void))
+{
+  __atomic_store_n(&watcher, notify, __ATOMIC_RELEASE);
+}
+
+static void notify_watcher(void)
+{
+  void (*notify)(void) = __atomic_load_n(&watcher, __ATOMIC_ACQUIRE);
+  if (NULL != notify) notify();
+}
+
+const aesd_log_ops_t *aesd_log_backend(void)
+{
+  return ops;
+}
+
+int aesd_log_fd(void)
+{
+  return (NULL != ops->fd) ? ops->fd() : -1;
+}
+
+// Takes the log lock for work on the log, returns when it got it
+static uint64_t log_lock_take(void)
+{
+  uint64_t start = metrics_now();
+  pthread_mutex_lock(&log_lock);
+  uint64_t locked = metrics_now();
+  metrics_record(HIST_LOCK_WAIT, locked - start);
+  return locked;
+}
+
+static void log_lock_release(uint64_t locked)
+{
+  uint64_t held = metrics_now() - locked;
+  pthread_mutex_unlock(&log_lock);
+  metrics_record(HIST_LOCK_HOLD, held);
+}
+
+int aesd_log_reserve(size_t len, off_t *off)
+{
+  if (NULL == ops->write_at) return -1;
+
+  uint64_t locked = log_lock_take();
+  *off = reserved;
+  reserved += len;
+  log_lock_release(locked);
+  return 0;
+}
+
+// Never blocks, so event loops can commit from their completion handlers
+// even while one of their own earlier writes is still in flight
+void aesd_log_commit(off_t off, size_t len)
+{
+  uint64_t locked = log_lock_take();
+  if (off != committed) {
+    // keep pending sorted by offset, out of order commits are rare
+    if (pending_count == pending_size) {
+      size_t size = pending_size ? pending_size * 2 : 16;
+      commit_range_t *ranges = realloc(pending, size * sizeof(commit_range_t));
+      if (NULL == ranges) {
+        // can't track it, wait for the gap instead
+        while (off != committed) pthread_cond_wait(&commit_cond, &log_lock);
+        goto COMMIT;
+      }
+      pending = ranges;
+      pending_size = size;
+    }
+    size_t i = pending_count;
+    while (i > 0 && pending[i - 1].off > off) {
+      pending[i] = pending[i - 1];
+      i--;
+    }
+    pending[i].off = off;
+    pending[i].end = off + len;
+    pending_count++;
+    log_lock_release(locked);
+    return;
+  }
+
+COMMIT:
+  off += len;
+  // everything queued right behind us is complete as well
+  size_t done = 0;
+  while (done < pending_count && pending[done].off == off) {
+    off = pending[done].end;
+    done++;
+  }
+  if (done > 0) {
+    memmove(pending, pending + done, (pending_count - done) * sizeof(commit_range_t));
+    pending_count -= done;
+  }
+  __atomic_store_n(&committed, off, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&commit_cond);
+  log_lock_release(locked);
+  notify_watcher();
+}
+
+bool aesd_log_committed(off_t end)
+{
+  return __atomic_load_n(&committed, __ATOMIC_ACQUIRE) >= end;
+}
+
+// Waits until everything before end is committed
+static void wait_committed(off_t end)
+{
+  if (aesd_log_committed(end)) return;
+  pthread_mutex_lock(&log_lock);
+  while (committed < end) pthread_cond_wait(&commit_cond, &log_lock);
+  pthread_mutex_unlock(&log_lock);
+}
+
+static int log_append(const char *data, size_t len)
+{
+  int rc = 0;
+
+  if (NULL == ops->write_at) {
+    uint64_t locked = log_lock_take();
+    rc = ops->append(data, len);
+    log_lock_release(locked);
+    notify_watcher();
+    return rc;
+  }
+
+  off_t off;
+  aesd_log_reserve(len, &off);
+  if (ops->write_at(data, len, off) < 0) {
+    // the range is committed anyway, later writers must not wait on it
+    FK_DEBUG("\tfailed: %d\n", errno);
+    rc = -1;
+  }
+  aesd_log_commit(off, len);
+
+  // our data is only visible once everything before it is written too
+  wait_committed(off + len);
+  return rc;
+}
+
+int aesd_log_iov_advance(struct iovec **iov, int iovcnt, size_t len)
+{
+  while (iovcnt > 0 && len >= (*iov)->iov_len) {
+    len -= (*iov)->iov_len;
+    (*iov)++;
+    iovcnt--;
+  }
+  if (iovcnt > 0) {
+    (*iov)->iov_base = (char *) (*iov)->iov_base + len;
+    (*iov)->iov_len -= len;
+  }
+  return iovcnt;
+}
+
+// Writes one batch, everything is visible once this returns
+static int batch_flush(struct iovec *iov, int iovcnt)
+{
+  int rc = 0;
+
+  if (NULL == ops->write_at) {
+    uint64_t locked = log_lock_take();
+    if (NULL != ops->appendv) {
+      rc = ops->appendv(iov, iovcnt);
+    } else {
+      for (int i = 0; i < iovcnt; i++) {
+        if (ops->append(iov[i].iov_base, iov[i].iov_len) < 0) rc = -1;
+      }
+    }
+    log_lock_release(locked);
+    notify_watcher();
+    return rc;
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+  off_t off;
+  aesd_log_reserve(total, &off);
+  if (NULL != ops->writev_at) {
+    if (ops->writev_at(iov, iovcnt, off) < 0) rc = -1;
+  } else {
+    off_t at = off;
+    for (int i = 0; i < iovcnt; i++) {
+      if (ops->write_at(iov[i].iov_base, iov[i].iov_len, at) < 0) rc = -1;
+      at += iov[i].iov_len;
+    }
+  }
+  aesd_log_commit(off, total);
+
+  // only io_uring writes past the committer, wait for those in front
+  wait_committed(off + total);
+  return rc;
+}
+
+static void *committer(void *arg)
+{
+  pthread_mutex_lock(&batch.lock);
+  while (1) {
+    while (0 == batch.count) pthread_cond_wait(&batch.more, &batch.lock);
+
+    if (batch.delay_us > 0 && batch.count < batch.max) {
+      // give other writers a moment to join this batch
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (batch.delay_us % 1000000) * 1000;
+      deadline.tv_sec += batch.delay_us / 1000000 + deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (batch.count < batch.max) {
+        if (pthread_cond_timedwait(&batch.more, &batch.lock, &deadline) == ETIMEDOUT) break;
+      }
+    }
+
+    // take up to max lines, in arrival order
+    batch_item_t *first = batch.head;
+    batch_item_t *last = first;
+    int n = 0;
+    while (1) {
+      batch.iov[n].iov_base = (void *) last->data;
+      batch.iov[n].iov_len = last->len;
+      if (++n == batch.max || NULL == last->next) break;
+      last = last->next;
+    }
+    batch.head = last->next;
+    if (NULL == batch.head) batch.tail = &batch.head;
+    batch.count -= n;
+    pthread_mutex_unlock(&batch.lock);
+
+    int rc = batch_flush(batch.iov, n);
+
+    pthread_mutex_lock(&batch.lock);
+    for (batch_item_t *item = first; n > 0; n--, item = item->next) {
+      item->rc = rc;
+      item->done = true;
+    }
+    pthread_cond_broadcast(&batch.flushed);
+  }
+  return NULL;
+}
+
+int aesd_log_group_commit(int max, long delay_us)
+{
+  batch.iov = calloc(max, sizeof(struct iovec));
+  if (NULL == batch.iov) return -1;
+  batch.max = max;
+  batch.delay_us = delay_us;
+  if (pthread_create(&batch.pid, NULL, &committer, NULL) != 0) {
+    free(batch.iov);
+    return -1;
+  }
+  pthread_detach(batch.pid);
+  batch.enabled = true;
+  return 0;
+}
+
+int aesd_log_append_direct(const char *data, size_t len)
+{
+  return log_append(data, len);
+}
+
+int aesd_log_append(const char *data, size_t len)
+{
+  if (!batch.enabled) return log_append(data, len);
+
+  batch_item_t item = { .data = data, .len = len };
+  pthread_mutex_lock(&batch.lock);
+  *batch.tail = &item;
+  batch.tail = &item.next;
+  batch.count++;
+  if (batch.count == 1 || batch.count >= batch.max) pthread_cond_signal(&batch.more);
+  while (!item.done) pthread_cond_wait(&batch.flushed, &batch.lock);
+  pthread_mutex_unlock(&batch.lock);
+  return item.rc;
+}
+
+// Copies [0, len) of src to the log at off without a userspace buffer
+// when the kernel can
+static int copy_to_log(int src, int logfd, off_t off, size_t len)
+{
+  loff_t in = 0;
+  loff_t out = off;
+
+  while ((size_t) in < len) {
+    ssize_t n = copy_file_range(src, &in, logfd, &out, len - in, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n > 0) continue;
+    if (n == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+                   errno != EOPNOTSUPP)) {
+      return -1;
+    }
+    // not between these two files, copy the rest by hand
+    char buf[BUFFER_SIZE * 16];
+    while ((size_t) in < len) {
+      size_t want = len - in < sizeof(buf) ? len - in : sizeof(buf);
+      ssize_t got = pread(src, buf, want, in);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0 || ops->write_at(buf, got, out) < 0) return -1;
+      in += got;
+      out += got;
+    }
+  }
+  return 0;
+}
+
+int aesd_log_append_fd(int src, size_t len)
+{
+  int logfd = aesd_log_fd();
+  int rc = 0;
+
+  if (NULL == ops->write_at || logfd < 0) {
+    // has to go through memory, append it in one piece all the same
+    char *data = malloc(len);
+    if (NULL == data) return -1;
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = pread(src, data + got, len - got, got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+    }
+    rc = (got == len) ? aesd_log_append(data, len) : -1;
+    free(data);
+    return rc;
+  }
+
+  off_t off;
+  aesd_log_reserve(len, &off);
+  if (copy_to_log(src, logfd, off, len) < 0) {
+    FK_DEBUG("\tfailed: %d\n", errno);
+    rc = -1;
+  }
+  aesd_log_commit(off, len);
+  wait_committed(off + len);
+  return rc;
+}
+
+int aesd_log_snapshot(aesd_log_reply_t *reply, const struct aesd_seekto *seekto)
+{
+  int rc;
+
+  reply->fd = -1;
+  reply->data = NULL;
+  reply->iovcnt = 0;
+  reply->pos = 0;
+  reply->end = 0;
+  reply->base = 0;
+  reply->head_len = 0;
+  reply->head_sent = 0;
+  reply->started = metrics_now();
+  if (NULL != ops->write_at) {
+    rc = ops->snapshot(reply, seekto, __atomic_load_n(&committed, __ATOMIC_ACQUIRE));
+  } else {
+    uint64_t locked = log_lock_take();
+    rc = ops->snapshot(reply, seekto, 0);
+    log_lock_release(locked);
+  }
+  reply->size = reply->end - reply->pos;
+  return rc;
+}
+
+int aesd_log_snapshot_from(aesd_log_reply_t *reply, off_t from)
+{
+  if (aesd_log_snapshot(reply, NULL) < 0) return -1;
+
+  off_t pos = from - reply->base;
+  if (pos < 0) pos = 0;
+  if (pos > reply->end) pos = reply->end;
+  reply->pos = pos;
+  reply->head_len = snprintf(reply->head, sizeof(reply->head), RESUME_HEAD "%lld,%lld\n",
+                             (long long) (reply->base + reply->end),
+                             (long long) (reply->end - pos));
+  reply->size = reply->head_len + reply->end - pos;
+  return 0;
+}
+
+bool aesd_log_reply_done(const aesd_log_reply_t *reply)
+{
+  return reply->head_sent >= reply->head_len && reply->pos >= reply->end;
+}
+
+void aesd_log_reply_sent(const aesd_log_reply_t *reply)
+{
+  metrics_since(HIST_REPLY_TIME, reply->started);
+  metrics_record(HIST_REPLY_SIZE, reply->size);
+  metrics_add(COUNTER_BYTES_OUT, reply->size);
+}
+
+void aesd_log_reply_free(aesd_log_reply_t *reply)
+{
+  free(reply->data);
+  reply->data = NULL;
+  if (reply->iovcnt > 0 && NULL != ops->reply_free) ops->reply_free(reply);
+  reply->iovcnt = 0;
+}
+
+int aesd_log_reply_read(const aesd_log_reply_t *reply, off_t pos, size_t len, char *buf)
+{
+  if (NULL != reply->data) {
+    memcpy(buf, reply->data + pos, len);
+    return 0;
+  }
+  if (reply->iovcnt > 0) {
+    size_t skip = pos;
+    size_t copied = 0;
+    for (int i = 0; i < reply->iovcnt && copied < len; i++) {
+      size_t iov_len = reply->iov[i].iov_len;
+      if (skip >= iov_len) {
+        skip -= iov_len;
+        continue;
+      }
+      size_t n = iov_len - skip;
+      if (n > len - copied) n = len - copied;
+      memcpy(buf + copied, (const char *) reply->iov[i].iov_base + skip, n);
+      copied += n;
+      skip = 0;
+    }
+    return copied == len ? 0 : -1;
+  }
+
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = pread(reply->fd, buf + got, len - got, pos + got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    got += n;
+  }
+  return 0;
+}
+
+int aesd_log_reply_iov(const aesd_log_reply_t *reply, struct iovec *iov)
+{
+  size_t skip = reply->pos;
+  int count = 0;
+
+  for (int i = 0; i < reply->iovcnt; i++) {
+    if (skip >= reply->iov[i].iov_len) {
+      skip -= reply->iov[i].iov_len;
+      continue;
+    }
+    iov[count].iov_base = (char *) reply->iov[i].iov_base + skip;
+    iov[count].iov_len = reply->iov[i].iov_len - skip;
+    skip = 0;
+    count++;
+  }
+  return count;
+}
+
+ssize_t aesd_log_reply_send(int c, aesd_log_reply_t *reply)
+{
+  ssize_t sent;
+
+  if (reply->head_sent < reply->head_len) {
+    int more = (reply->pos < reply->end) ? MSG_MORE : 0;
+    sent = send(c, reply->head + reply->head_sent, reply->head_len - reply->head_sent,
+                MSG_NOSIGNAL | more);
+    if (sent > 0) reply->head_sent += sent;
+    return sent;
+  }
+  if (reply->pos >= reply->end) return 0;
+  if (NULL != reply->data) {
+    sent = send(c, reply->data + reply->pos, reply->end - reply->pos, MSG_NOSIGNAL);
+  } else if (reply->iovcnt > 0) {
+    // writev() for sockets, without the SIGPIPE
+    struct iovec iov[AESD_LOG_MAX_IOV];
+    struct msghdr msg = {
+      .msg_iov = iov,
+      .msg_iovlen = aesd_log_reply_iov(reply, iov),
+    };
+    sent = sendmsg(c, &msg, MSG_NOSIGNAL);
+  } else {
+    // sendfile moves pos itself
+    return sendfile(c, reply->fd, &reply->pos, reply->end - reply->pos);
+  }
+  if (sent > 0) reply->pos += sent;
+  return sent;
+}
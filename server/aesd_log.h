@@ -0,0 +1,143 @@
+#ifndef _AESD_LOG__H_
+#define _AESD_LOG__H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+// Append-only log shared by all connections.
+//
+// Offset addressed backends (the log file) never hold a lock while data
+// moves: a writer reserves a range, writes it and commits it, readers
+// only look at the committed end. Commits may complete out of order, the
+// committed end only moves past ranges that are completely written.
+// Other backends (the char device, the in-process ring) serialize
+// appends and snapshots on a lock, snapshots are copied out or pin the
+// memory they point to so replies are sent without it.
+//
+// With group commit enabled appends are handed to a committer thread,
+// which writes everything pending with one writev and wakes the writers.
+
+#define AESD_LOG_MAX_IOV AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+#define READFROM_CMD "AESDCHAR_READFROM:"
+#define RESUME_HEAD "AESDCHAR_RESUME:"
+
+// A consistent view of the log for one reply
+typedef struct aesd_log_reply_s aesd_log_reply_t;
+struct aesd_log_reply_s {
+  int fd;         // file to send [pos, end) from, -1 when data is used
+  char *data;     // owned copy of the log, NULL when fd is used
+  // or the log in pieces, positions count across all of them
+  struct iovec iov[AESD_LOG_MAX_IOV];
+  int iovcnt;
+  off_t pos;      // next byte to send
+  off_t end;      // end of the snapshot
+  // log offset of position 0, more than 0 when older data is gone
+  off_t base;
+  // sent before the log, the resume token of AESDCHAR_READFROM
+  char head[64];
+  size_t head_len;
+  size_t head_sent;
+  // for the reply metrics
+  uint64_t started;
+  size_t size;
+};
+
+typedef struct aesd_log_ops_s aesd_log_ops_t;
+struct aesd_log_ops_s {
+  const char *name;
+  bool timestamps;    // gets a timestamp: line every 10 seconds
+  bool blocking;      // appends wait for a device, keep event loops off it
+  // keeps the first `resume` bytes of an existing log (a restart
+  // handoff), 0 starts an empty one. Optional, for backends that set
+  // themselves up on first use.
+  int (*open)(off_t resume);
+  // removes what open created, must be async-signal-safe
+  void (*cleanup)(void);
+  // descriptor to write reserved ranges to, NULL when only write_at can
+  int (*fd)(void);
+  // offset addressed backends: writes a reserved range, no lock held
+  ssize_t (*write_at)(const char *data, size_t len, off_t off);
+  // optional, writes a batch of lines into one reserved range, iov may
+  // be modified
+  ssize_t (*writev_at)(struct iovec *iov, int iovcnt, off_t off);
+  // other backends: appends with the log lock held
+  int (*append)(const char *data, size_t len);
+  // optional, appends a batch of lines with the log lock held, iov may
+  // be modified
+  int (*appendv)(struct iovec *iov, int iovcnt);
+  // fills reply from the start of the log, or the seek position when
+  // seekto is set, and sets base. end is the committed end for offset
+  // addressed backends, the others are called with the log lock held.
+  int (*snapshot)(aesd_log_reply_t *reply, const struct aesd_seekto *seekto, off_t end);
+  // unpins the iov of a reply, called without the log lock
+  void (*reply_free)(aesd_log_reply_t *reply);
+};
+
+extern const aesd_log_ops_t aesd_log_file_ops;
+extern const aesd_log_ops_t aesd_log_device_ops;
+extern const aesd_log_ops_t aesd_log_ring_ops;
+extern const aesd_log_ops_t aesd_log_mmap_ops;
+
+int aesd_log_init(const aesd_log_ops_t *backend, off_t resume);
+// Starts the committer, appends wait for up to `batch` lines or
+// `delay_us` microseconds to be written together
+int aesd_log_group_commit(int batch, long delay_us);
+void aesd_log_cleanup(void);
+// Blocks every further append and returns where the log ends once all
+// writes in flight are committed, -1 when the backend is not offset
+// addressed. Used to hand the log over to a new server.
+off_t aesd_log_seal(void);
+const aesd_log_ops_t *aesd_log_backend(void);
+// Calls notify after every append once it is visible to snapshots, from
+// the appending thread and without the log lock. One watcher at a time.
+void aesd_log_watch(void (*notify)(void));
+int aesd_log_fd(void);
+
+// Appends data, when this returns the data is visible to new snapshots
+int aesd_log_append(const char *data, size_t len);
+// Same past the group commit, for event loops that must not wait for a
+// batch to fill. Still waits for the writes in front of it.
+int aesd_log_append_direct(const char *data, size_t len);
+
+// Appends the first len bytes of the file src (a staging file) as one
+// piece. With the log file they are copied in the kernel, into a reserved
+// range and without the log lock.
+int aesd_log_append_fd(int src, size_t len);
+
+// Split append for callers doing the write themselves (io_uring).
+// Reserve returns -1 when the backend is not offset addressed.
+int aesd_log_reserve(size_t len, off_t *off);
+void aesd_log_commit(off_t off, size_t len);
+// True once everything before end is committed
+bool aesd_log_committed(off_t end);
+
+int aesd_log_snapshot(aesd_log_reply_t *reply, const struct aesd_seekto *seekto);
+// Snapshot of what was appended since log offset `from`, preceded by
+// "AESDCHAR_RESUME:<next offset>,<length>\n". Offsets older than the
+// backend keeps are sent from the oldest data still there.
+int aesd_log_snapshot_from(aesd_log_reply_t *reply, off_t from);
+// True once the head and [pos, end) are sent
+bool aesd_log_reply_done(const aesd_log_reply_t *reply);
+// Records size and duration of a reply that was sent completely
+void aesd_log_reply_sent(const aesd_log_reply_t *reply);
+void aesd_log_reply_free(aesd_log_reply_t *reply);
+// Replaces the log data of a snapshot with one LZ4 frame of it, the head
+// stays plain text. Blocks of offset addressed logs are cached.
+int aesd_log_reply_compress(aesd_log_reply_t *reply);
+// Skips `len` written bytes of iov, returns the new iovcnt
+int aesd_log_iov_advance(struct iovec **iov, int iovcnt, size_t len);
+// Copies reply bytes [pos, pos + len) into buf
+int aesd_log_reply_read(const aesd_log_reply_t *reply, off_t pos, size_t len, char *buf);
+// Fills iov with the unsent part of an iov reply, returns the count
+int aesd_log_reply_iov(const aesd_log_reply_t *reply, struct iovec *iov);
+// Sends the next part of the reply with one syscall and advances pos.
+// Returns what send() would, errno is left for the caller to look at.
+ssize_t aesd_log_reply_send(int c, aesd_log_reply_t *reply);
+
+#endif
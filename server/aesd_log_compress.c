@@ -0,0 +1,181 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include "lz4.h"
+#include "async_log.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// LZ4 framed replies. The reply is cut into blocks at LZ4_BLOCK_MAX
+// aligned log offsets. With offset addressed backends a complete block
+// never changes, so it is compressed once and kept for every later reply;
+// only the tail of the log is compressed per reply.
+
+// compressed bytes kept at most, later blocks are compressed every time
+#define CACHE_MAX (64UL * 1024 * 1024)
+
+// a finished frame block, size field included
+typedef struct cached_block_s cached_block_t;
+struct cached_block_s {
+  size_t len;
+  char data[];
+};
+
+// indexed by log offset / LZ4_BLOCK_MAX, entries are never freed so
+// replies copy from them without the lock
+static cached_block_t **cache = NULL;
+static size_t cache_size = 0;
+static size_t cache_bytes = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cached_block_t *cache_get(size_t index)
+{
+  cached_block_t *block = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  if (index < cache_size) block = cache[index];
+  pthread_mutex_unlock(&cache_lock);
+  return block;
+}
+
+// Keeps block unless another reply was faster, returns the one to use
+static cached_block_t *cache_put(size_t index, cached_block_t *block)
+{
+  pthread_mutex_lock(&cache_lock);
+  if (index >= cache_size) {
+    size_t size = cache_size ? cache_size : 64;
+    while (size <= index) size *= 2;
+    cached_block_t **grown = realloc(cache, size * sizeof(cached_block_t *));
+    if (NULL == grown) goto FULL;
+    memset(grown + cache_size, 0, (size - cache_size) * sizeof(cached_block_t *));
+    cache = grown;
+    cache_size = size;
+  }
+  if (NULL != cache[index]) {
+    free(block);
+    block = cache[index];
+  } else if (cache_bytes + block->len <= CACHE_MAX) {
+    cache[index] = block;
+    cache_bytes += block->len;
+  } else {
+    goto FULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return block;
+
+FULL:
+  pthread_mutex_unlock(&cache_lock);
+  return NULL;
+}
+
+// Points at reply bytes [pos, pos + len), copied into scratch unless the
+// reply holds them in one piece
+static const char *reply_bytes(const aesd_log_reply_t *reply, off_t pos, size_t len, char *scratch)
+{
+  if (NULL != reply->data) return reply->data + pos;
+
+  if (reply->iovcnt > 0) {
+    size_t skip = pos;
+    size_t copied = 0;
+    for (int i = 0; i < reply->iovcnt && copied < len; i++) {
+      size_t iov_len = reply->iov[i].iov_len;
+      if (skip >= iov_len) {
+        skip -= iov_len;
+        continue;
+      }
+      size_t n = iov_len - skip;
+      if (n > len - copied) n = len - copied;
+      if (copied == 0 && n == len) return (const char *) reply->iov[i].iov_base + skip;
+      memcpy(scratch + copied, (const char *) reply->iov[i].iov_base + skip, n);
+      copied += n;
+      skip = 0;
+    }
+    return copied == len ? scratch : NULL;
+  }
+
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = pread(reply->fd, scratch + got, len - got, pos + got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return NULL;
+    got += n;
+  }
+  return scratch;
+}
+
+int aesd_log_reply_compress(aesd_log_reply_t *reply)
+{
+  bool stable = NULL != aesd_log_backend()->write_at;
+  size_t blocks = (reply->end - reply->pos) / LZ4_BLOCK_MAX + 2;
+  size_t size = LZ4_FRAME_HEADER_SIZE + 4;
+  size_t len = 0;
+  char *scratch = NULL;
+  char *out;
+
+  // room for the first blocks, the rest mostly comes from the cache
+  // and grows the buffer by what it really needs
+  size += (blocks > 4 ? 4 : blocks) * (4 + LZ4_BOUND(LZ4_BLOCK_MAX));
+  out = malloc(size);
+  if (NULL == out) return -1;
+  memcpy(out, lz4_frame_header, LZ4_FRAME_HEADER_SIZE);
+  len = LZ4_FRAME_HEADER_SIZE;
+
+  off_t pos = reply->pos;
+  while (pos < reply->end) {
+    off_t log_off = reply->base + pos;
+    size_t n = LZ4_BLOCK_MAX - log_off % LZ4_BLOCK_MAX;
+    if ((off_t) n > reply->end - pos) n = reply->end - pos;
+    bool whole = stable && n == LZ4_BLOCK_MAX;
+    size_t index = log_off / LZ4_BLOCK_MAX;
+
+    cached_block_t *block = whole ? cache_get(index) : NULL;
+    size_t need = (NULL != block) ? block->len : 4 + LZ4_BOUND(n);
+    if (len + need + 4 > size) {
+      while (len + need + 4 > size) size *= 2;
+      char *grown = realloc(out, size);
+      if (NULL == grown) goto ERR_COMPRESS;
+      out = grown;
+    }
+
+    if (NULL != block) {
+      memcpy(out + len, block->data, block->len);
+      len += block->len;
+    } else {
+      if (NULL == scratch) {
+        scratch = malloc(LZ4_BLOCK_MAX);
+        if (NULL == scratch) goto ERR_COMPRESS;
+      }
+      const char *src = reply_bytes(reply, pos, n, scratch);
+      if (NULL == src) goto ERR_COMPRESS;
+      size_t written = lz4_frame_block(src, n, out + len);
+      if (whole) {
+        block = malloc(sizeof(cached_block_t) + written);
+        if (NULL != block) {
+          block->len = written;
+          memcpy(block->data, out + len, written);
+          if (NULL == cache_put(index, block)) free(block);
+        }
+      }
+      len += written;
+    }
+    pos += n;
+  }
+  // end mark
+  memset(out + len, 0, 4);
+  len += 4;
+  free(scratch);
+
+  // the frame replaces the log data, the head is still sent first
+  aesd_log_reply_free(reply);
+  reply->fd = -1;
+  reply->data = out;
+  reply->pos = 0;
+  reply->end = len;
+  reply->size = reply->head_len + len;
+  return 0;
+
+ERR_COMPRESS:
+  ALOG(LOG_ERR, "Compressing reply failed: %d", errno);
+  free(scratch);
+  free(out);
+  return -1;
+}
@@ -0,0 +1,199 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+// AESD_CHAR_DEVICE backend: the driver keeps the last few writes in its
+// circular buffer, so offsets are not stable and every append and
+// snapshot runs with the log lock held. The device is read into an image
+// that every snapshot shares until the next append, replies pin it and
+// are sent without the lock. Reads follow appends, not replies. Evicting
+// an entry renumbers the driver's offsets, so a new image is read whole;
+// it is only ever the last few writes.
+
+static int device_fd = -1;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes the driver has committed through us, gives the snapshots a log
+// offset as long as nobody else writes to the device. Data without a \n
+// is held by the driver until the line completes.
+static off_t appended = 0;
+static off_t held = 0;
+
+// The device content at one generation, never changed once read
+typedef struct device_image_s device_image_t;
+struct device_image_s {
+  int refs;   // the cache plus every reply still sending it
+  uint64_t generation;
+  size_t len;
+  char data[];
+};
+
+// bumped by every append, as long as nobody else writes to the device
+// the cached image is current while the generation matches
+static uint64_t generation = 0;
+static device_image_t *image = NULL;
+
+static device_image_t *device_image_of(const void *data)
+{
+  return (device_image_t *) ((const char *) data - offsetof(device_image_t, data));
+}
+
+static void device_image_put(device_image_t *img)
+{
+  if (NULL != img && __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) == 0) free(img);
+}
+
+// Called with what the driver took only, a failed write moves nothing
+static void device_count(const char *data, size_t len)
+{
+  generation++;
+  if (NULL == memchr(data, '\n', len)) {
+    held += len;
+  } else {
+    appended += held + len;
+    held = 0;
+  }
+}
+
+// Counts the first n bytes of iov, before it is advanced past them
+static void device_count_iov(const struct iovec *iov, size_t n)
+{
+  for (; n > 0; iov++) {
+    size_t len = iov->iov_len < n ? iov->iov_len : n;
+    device_count(iov->iov_base, len);
+    n -= len;
+  }
+}
+
+// Opened on first use, the driver might not be loaded when we start
+static int device_get_fd(void)
+{
+  pthread_mutex_lock(&open_lock);
+  if (device_fd < 0) {
+    device_fd = open(AESD_CHAR_DEVICE, O_RDWR | O_CLOEXEC, 0644);
+    if (device_fd < 0) {
+      syslog(LOG_ERR, "OPpenfile failed: %d", errno);
+    }
+  }
+  pthread_mutex_unlock(&open_lock);
+  return device_fd;
+}
+
+static int device_append(const char *data, size_t len)
+{
+  int fd = device_get_fd();
+  if (fd < 0) return -1;
+
+  // the driver commits an entry when it sees the \n
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(fd, data + written, len - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    written += n;
+  }
+  if (written > 0) device_count(data, written);
+  return written == len ? 0 : -1;
+}
+
+// One writev, the driver still sees every line as a write of its own
+static int device_appendv(struct iovec *iov, int iovcnt)
+{
+  int fd = device_get_fd();
+  if (fd < 0) return -1;
+
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    device_count_iov(iov, n);
+    iovcnt = aesd_log_iov_advance(&iov, iovcnt, n);
+  }
+  return 0;
+}
+
+// Reads everything the driver has, log lock held. NULL when the read
+// failed, a short image must never be cached.
+static device_image_t *device_image_read(int fd)
+{
+  // about as much as last time
+  size_t size = (NULL != image) ? image->len + BUFFER_SIZE : BUFFER_SIZE * 4;
+  size_t len = 0;
+  device_image_t *img = malloc(sizeof(device_image_t) + size);
+  if (NULL == img) return NULL;
+
+  while (1) {
+    if (len == size) {
+      size *= 2;
+      device_image_t *grown = realloc(img, sizeof(device_image_t) + size);
+      if (NULL == grown) {
+        free(img);
+        return NULL;
+      }
+      img = grown;
+    }
+    ssize_t n = pread(fd, img->data + len, size - len, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      syslog(LOG_ERR, "Error reading %s: %d", AESD_CHAR_DEVICE, errno);
+      free(img);
+      return NULL;
+    }
+    if (n == 0) break;
+    len += n;
+  }
+  img->refs = 1;
+  img->generation = generation;
+  img->len = len;
+  return img;
+}
+
+static int device_snapshot(aesd_log_reply_t *reply, const struct aesd_seekto *seekto, off_t end)
+{
+  int fd = device_get_fd();
+  if (fd < 0) return -1;
+
+  off_t pos = 0;
+  if (NULL != seekto) {
+    ioctl(fd, AESDCHAR_IOCSEEKTO, (unsigned long) seekto);
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) pos = 0;
+  }
+
+  if (NULL == image || image->generation != generation) {
+    device_image_t *fresh = device_image_read(fd);
+    if (NULL == fresh) return -1;
+    device_image_put(image);
+    image = fresh;
+  }
+  __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+  reply->iov[0].iov_base = image->data;
+  reply->iov[0].iov_len = image->len;
+  reply->iovcnt = 1;
+  reply->end = image->len;
+  reply->pos = (pos < reply->end) ? pos : reply->end;
+  // position 0 of the reply is the oldest byte the driver still has
+  reply->base = (appended > reply->end) ? appended - reply->end : 0;
+  return 0;
+}
+
+static void device_reply_free(aesd_log_reply_t *reply)
+{
+  device_image_put(device_image_of(reply->iov[0].iov_base));
+}
+
+const aesd_log_ops_t aesd_log_device_ops = {
+  .name = "device",
+  .timestamps = false,
+  .blocking = true,
+  .fd = device_get_fd,
+  .append = device_append,
+  .appendv = device_appendv,
+  .snapshot = device_snapshot,
+  .reply_free = device_reply_free,
+};
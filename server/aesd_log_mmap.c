@@ -0,0 +1,117 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// LOG_FILE backend writing through a shared mapping: appends are a
+// memcpy() into their reserved range and replies are sent straight from
+// the mapped pages. The file is preallocated in MMAP_EXTENT steps, so it
+// is larger than the log while we run, the tail is zeros.
+//
+// The whole address range is reserved up front and extents are mapped
+// into it as the file grows, the log never moves and replies can keep
+// pointing into it without pinning anything.
+
+#define MMAP_EXTENT (16UL * 1024 * 1024)
+#define MMAP_RESERVE (sizeof(void *) > 4 ? (64ULL << 30) : (256ULL << 20))
+
+static int mmap_fd = -1;
+static char *base = NULL;
+static size_t mapped = 0;     // also read without grow_lock
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mmap_grow(size_t need);
+
+static int mmap_open(off_t resume)
+{
+  mmap_fd = open(LOG_FILE, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (mmap_fd < 0) {
+    syslog(LOG_ERR, "OPpenfile failed: %d", mmap_fd);
+    return -1;
+  }
+  // drops the preallocated zeros after the end of a handed over log
+  if (ftruncate(mmap_fd, resume) < 0) {
+    syslog(LOG_ERR, "Truncating log failed: %d", errno);
+    close(mmap_fd);
+    return -1;
+  }
+
+  // PROT_NONE and MAP_NORESERVE, this costs no memory until mapped
+  base = mmap(NULL, MMAP_RESERVE, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    syslog(LOG_ERR, "Reserving log mapping failed: %d", errno);
+    base = NULL;
+    close(mmap_fd);
+    return -1;
+  }
+  // snapshots send the handed over part straight away
+  if (resume > 0 && mmap_grow(resume) < 0) return -1;
+  return 0;
+}
+
+static void mmap_cleanup(void)
+{
+  unlink(LOG_FILE);
+}
+
+// Maps more of the file until [0, need) is covered
+static int mmap_grow(size_t need)
+{
+  int rc = 0;
+
+  pthread_mutex_lock(&grow_lock);
+  while (mapped < need) {
+    if (mapped + MMAP_EXTENT > MMAP_RESERVE) {
+      errno = ENOSPC;
+      rc = -1;
+      break;
+    }
+    // preallocate so stores into the mapping can't hit a full disk
+    if (fallocate(mmap_fd, 0, mapped, MMAP_EXTENT) < 0 &&
+        ftruncate(mmap_fd, mapped + MMAP_EXTENT) < 0) {
+      rc = -1;
+      break;
+    }
+    void *extent = mmap(base + mapped, MMAP_EXTENT, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, mmap_fd, mapped);
+    if (extent == MAP_FAILED) {
+      rc = -1;
+      break;
+    }
+    __atomic_store_n(&mapped, mapped + MMAP_EXTENT, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&grow_lock);
+  if (rc < 0) syslog(LOG_ERR, "Growing log mapping failed: %d", errno);
+  return rc;
+}
+
+static ssize_t mmap_write_at(const char *data, size_t len, off_t off)
+{
+  if (__atomic_load_n(&mapped, __ATOMIC_ACQUIRE) < (size_t) off + len) {
+    if (mmap_grow(off + len) < 0) return -1;
+  }
+  memcpy(base + off, data, len);
+  return len;
+}
+
+static int mmap_snapshot(aesd_log_reply_t *reply, const struct aesd_seekto *seekto, off_t end)
+{
+  reply->iov[0].iov_base = base;
+  reply->iov[0].iov_len = end;
+  reply->iovcnt = (end > 0) ? 1 : 0;
+  reply->end = end;
+  // same as the file backend, seeking leaves nothing to send
+  reply->pos = (NULL != seekto) ? end : 0;
+  return 0;
+}
+
+const aesd_log_ops_t aesd_log_mmap_ops = {
+  .name = "mmap",
+  .timestamps = true,
+  .open = mmap_open,
+  .cleanup = mmap_cleanup,
+  .write_at = mmap_write_at,
+  .snapshot = mmap_snapshot,
+};
@@ -0,0 +1,136 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include <stdlib.h>
+#include <stddef.h>
+
+// In-process backend with the char device semantics: the last
+// AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes are kept in the same
+// circular buffer the driver uses, data without a \n is held back until
+// one arrives. Appends and snapshots run with the log lock held,
+// snapshots pin the entries so replies are sent from memory without it.
+// Nothing survives the process, so there is no handoff with -H.
+
+// buffptr of a circular buffer entry points at data
+typedef struct ring_entry_s ring_entry_t;
+struct ring_entry_s {
+  int refs;   // the ring plus every reply still sending it
+  char data[];
+};
+
+static struct aesd_circular_buffer ring;
+static char *partial = NULL;
+static size_t partial_len = 0;
+static off_t dropped = 0;     // bytes overwritten since the start
+
+static ring_entry_t *ring_entry_of(const void *buffptr)
+{
+  return (ring_entry_t *) ((const char *) buffptr - offsetof(ring_entry_t, data));
+}
+
+static void ring_entry_put(ring_entry_t *entry)
+{
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) free(entry);
+}
+
+static int ring_open(off_t resume)
+{
+  aesd_circular_buffer_init(&ring);
+  return 0;
+}
+
+static int ring_append(const char *data, size_t len)
+{
+  if (NULL == memchr(data, '\n', len)) {
+    char *grown = realloc(partial, partial_len + len);
+    if (NULL == grown) return -1;
+    memcpy(grown + partial_len, data, len);
+    partial = grown;
+    partial_len += len;
+    return 0;
+  }
+
+  // like the driver, everything up to the end of this write is one entry
+  ring_entry_t *entry = malloc(sizeof(ring_entry_t) + partial_len + len);
+  if (NULL == entry) return -1;
+  entry->refs = 1;
+  if (partial_len > 0) memcpy(entry->data, partial, partial_len);
+  memcpy(entry->data + partial_len, data, len);
+
+  struct aesd_buffer_entry add = {
+    .buffptr = entry->data,
+    .size = partial_len + len,
+  };
+  free(partial);
+  partial = NULL;
+  partial_len = 0;
+
+  if (ring.full) dropped += ring.entry[ring.in_offs].size;
+  char *overwritten = aesd_circular_buffer_add_entry(&ring, &add);
+  if (NULL != overwritten) ring_entry_put(ring_entry_of(overwritten));
+  return 0;
+}
+
+// Log position of the seek command, -1 when it points past the log
+static off_t ring_seek_pos(const struct aesd_seekto *seekto)
+{
+  off_t pos = 0;
+  uint8_t index = ring.out_offs;
+
+  if (seekto->write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) return -1;
+  for (uint32_t cmd = 0; cmd < seekto->write_cmd; cmd++) {
+    if (0 == ring.entry[index].size) return -1;
+    pos += ring.entry[index].size;
+    if (++index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) index = 0;
+  }
+  if (seekto->write_cmd_offset >= ring.entry[index].size) return -1;
+  return pos + seekto->write_cmd_offset;
+}
+
+static int ring_snapshot(aesd_log_reply_t *reply, const struct aesd_seekto *seekto, off_t end)
+{
+  off_t pos = 0;
+  reply->base = dropped;
+  if (NULL != seekto) {
+    pos = ring_seek_pos(seekto);
+    // the driver leaves the file position alone, nothing is left to read
+    if (pos < 0) return 0;
+  }
+
+  size_t entry_offset;
+  struct aesd_buffer_entry *entry =
+    aesd_circular_buffer_find_entry_offset_for_fpos(&ring, pos, &entry_offset);
+  if (NULL == entry) return 0;
+
+  // whole entries are pinned, pos skips into the first one
+  uint8_t index = entry - ring.entry;
+  reply->pos = entry_offset;
+  reply->base = dropped + pos - entry_offset;
+  for (int i = 0; i < AESD_LOG_MAX_IOV; i++) {
+    entry = &ring.entry[index];
+    if (0 == entry->size) break;
+    __atomic_add_fetch(&ring_entry_of(entry->buffptr)->refs, 1, __ATOMIC_RELAXED);
+    reply->iov[i].iov_base = (void *) entry->buffptr;
+    reply->iov[i].iov_len = entry->size;
+    reply->iovcnt++;
+    reply->end += entry->size;
+    if (++index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) index = 0;
+    if (index == ring.in_offs) break;
+  }
+  return 0;
+}
+
+static void ring_reply_free(aesd_log_reply_t *reply)
+{
+  for (int i = 0; i < reply->iovcnt; i++) {
+    ring_entry_put(ring_entry_of(reply->iov[i].iov_base));
+  }
+}
+
+const aesd_log_ops_t aesd_log_ring_ops = {
+  .name = "ring",
+  .timestamps = false,
+  .open = ring_open,
+  .append = ring_append,
+  .snapshot = ring_snapshot,
+  .reply_free = ring_reply_free,
+};
@@ -0,0 +1,412 @@
+// Load generator for aesdsocket: every connection runs on its own thread
+// and sends lines (and optionally seek commands), checks that the reply
+// holds the line it just sent and records the latency. Build it with
+// `make aesdbench`.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+// on a persistent connection behind every line: its reply is an empty
+// RESUME_HEAD that marks where the reply to the line ended
+#define PAST_END_CMD "AESDCHAR_READFROM:9223372036854775807\n"
+#define RESUME_HEAD "AESDCHAR_RESUME:"
+#define HEAD_SIZE 64      // the longest resume head and then some
+#define RECV_SIZE (64 * 1024)
+#define REPLY_TIMEOUT 5   // seconds without the line showing up
+
+typedef struct bench_config_s bench_config_t;
+struct bench_config_s {
+  const char *host;
+  const char *port;
+  int connections;
+  long requests;      // per connection, unless duration is set
+  int duration;       // seconds
+  bool persistent;    // all requests on one connection, needs aesdsocket -k
+  size_t line_size;   // including the \n
+  double rate;        // lines per second over all connections, 0 for no limit
+  int seek_percent;
+};
+
+static bench_config_t config = {
+  .host = "127.0.0.1",
+  .port = "9000",
+  .connections = 8,
+  .requests = 1000,
+  .duration = 0,
+  .persistent = false,
+  .line_size = 64,
+  .rate = 0,
+  .seek_percent = 0,
+};
+
+static struct addrinfo *server = NULL;
+
+typedef struct bench_thread_s bench_thread_t;
+struct bench_thread_s {
+  pthread_t pid;
+  int id;
+  unsigned int seed;
+
+  uint64_t *latencies;    // ns, one per completed request
+  size_t count;
+  size_t size;
+
+  unsigned long connect_errors;
+  unsigned long io_errors;
+  unsigned long bad_replies;
+  unsigned long seeks;
+  uint64_t bytes_received;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+  struct timespec ts = {
+    .tv_sec = deadline / 1000000000ULL,
+    .tv_nsec = deadline % 1000000000ULL,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static int bench_connect(void)
+{
+  int c = socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+  if (c < 0) return -1;
+  if (connect(c, server->ai_addr, server->ai_addrlen) < 0) {
+    close(c);
+    return -1;
+  }
+  int on = 1;
+  setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  struct timeval timeout = { .tv_sec = REPLY_TIMEOUT };
+  setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return c;
+}
+
+static int send_all(int c, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(c, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Reads the reply until EOF when to_eof is set, otherwise until the
+// resume head of PAST_END_CMD behind the line, so nothing is left for the
+// next request to read. Only the last few bytes are kept between reads so
+// the whole log never has to be buffered.
+// Returns 1 when `line` was in the reply, 0 when it wasn't and -1 on errors.
+static int read_reply(bench_thread_t *t, int c, char *buf, const char *line,
+                      size_t line_len, bool to_eof)
+{
+  size_t keep = (line_len > HEAD_SIZE) ? line_len - 1 : HEAD_SIZE;
+  size_t kept = 0;
+  bool seen = false;
+
+  while (1) {
+    ssize_t n = recv(c, buf + kept, RECV_SIZE, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return -1;
+    if (n == 0) return to_eof ? seen : -1;
+    t->bytes_received += n;
+
+    size_t have = kept + n;
+    if (!seen && NULL != line && NULL != memmem(buf, have, line, line_len)) seen = true;
+    if (!to_eof) {
+      // the head follows the reply to the line, and ends with a \n
+      const char *head = memmem(buf, have, RESUME_HEAD, strlen(RESUME_HEAD));
+      if (NULL != head && NULL != memchr(head, '\n', buf + have - head)) return seen;
+    }
+    kept = (have > keep) ? keep : have;
+    memmove(buf, buf + have - kept, kept);
+  }
+}
+
+static void record(bench_thread_t *t, uint64_t latency)
+{
+  if (t->count == t->size) {
+    size_t size = t->size ? t->size * 2 : 4096;
+    uint64_t *grown = realloc(t->latencies, size * sizeof(uint64_t));
+    if (NULL == grown) return;
+    t->latencies = grown;
+    t->size = size;
+  }
+  t->latencies[t->count++] = latency;
+}
+
+// "<id>-<seq> " padded with x to line_size, unique for every request
+static size_t make_line(char *line, int id, long seq)
+{
+  int len = snprintf(line, config.line_size, "%d-%ld ", id, seq);
+  if (len < 0 || (size_t) len >= config.line_size - 1) len = config.line_size - 1;
+  memset(line + len, 'x', config.line_size - 1 - len);
+  line[config.line_size - 1] = '\n';
+  return config.line_size;
+}
+
+static void *bench_thread(void *arg)
+{
+  bench_thread_t *t = (bench_thread_t *) arg;
+  char *buf = malloc(RECV_SIZE + config.line_size + HEAD_SIZE);
+  char *line = malloc(config.line_size);
+  char seek[64];
+  int c = -1;
+
+  if (NULL == buf || NULL == line) {
+    t->io_errors++;
+    goto DONE;
+  }
+
+  // open loop: request i is due at start + i * interval, latency counts
+  // from when it was due so a slow server can't hide its queueing
+  uint64_t interval = config.rate > 0 ? (uint64_t) (1e9 * config.connections / config.rate) : 0;
+  uint64_t start = now_ns();
+  uint64_t stop = config.duration > 0 ? start + (uint64_t) config.duration * 1000000000ULL : 0;
+
+  for (long seq = 0; stop ? now_ns() < stop : seq < config.requests; seq++) {
+    uint64_t due = interval ? start + seq * interval : now_ns();
+    if (interval) sleep_until(due);
+
+    if (c < 0) {
+      c = bench_connect();
+      if (c < 0) {
+        t->connect_errors++;
+        continue;
+      }
+    }
+
+    size_t len = make_line(line, t->id, seq);
+    bool seeking = config.seek_percent > 0 && rand_r(&t->seed) % 100 < (unsigned) config.seek_percent;
+    int rc;
+    if (seeking && !config.persistent) {
+      // the reply depends on the backend, only check that one comes
+      int n = snprintf(seek, sizeof(seek), SEEKTO_CMD "0,0\n");
+      t->seeks++;
+      rc = send_all(c, seek, n);
+      if (rc == 0) shutdown(c, SHUT_WR);
+      if (rc == 0) rc = (read_reply(t, c, buf, NULL, 0, true) < 0) ? -1 : 1;
+    } else {
+      if (seeking) {
+        // a seek may have an empty reply, on a persistent connection it
+        // goes out in front of the line and shares its reply
+        int n = snprintf(seek, sizeof(seek), SEEKTO_CMD "0,0\n");
+        t->seeks++;
+        if (send_all(c, seek, n) < 0) goto IO_ERROR;
+      }
+      rc = send_all(c, line, len);
+      // one-shot: the server closes after its reply, with -k on our EOF
+      if (rc == 0 && !config.persistent) shutdown(c, SHUT_WR);
+      if (rc == 0 && config.persistent) rc = send_all(c, PAST_END_CMD, strlen(PAST_END_CMD));
+      if (rc == 0) rc = read_reply(t, c, buf, line, len, !config.persistent);
+    }
+    if (rc < 0) goto IO_ERROR;
+    if (rc == 0) t->bad_replies++;
+    record(t, now_ns() - due);
+    if (!config.persistent || rc == 0) {
+      // a persistent connection without the line lost track of its replies
+      close(c);
+      c = -1;
+    }
+    continue;
+
+IO_ERROR:
+    t->io_errors++;
+    close(c);
+    c = -1;
+  }
+
+DONE:
+  if (c >= 0) close(c);
+  free(buf);
+  free(line);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double q)
+{
+  size_t rank = (size_t) (q * count);
+  if (rank >= count) rank = count - 1;
+  return sorted[rank];
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-n requests] [-d seconds] [-k]\n"
+          "       [-s bytes] [-r rate] [-x percent]\n", name);
+  fprintf(stderr, "  -H, --host        server address, default %s\n", config.host);
+  fprintf(stderr, "  -p, --port        server port, default %s\n", config.port);
+  fprintf(stderr, "  -c, --connections concurrent connections, one thread each, default %d\n", config.connections);
+  fprintf(stderr, "  -n, --requests    requests per connection, default %ld\n", config.requests);
+  fprintf(stderr, "  -d, --duration    run for this many seconds instead of -n\n");
+  fprintf(stderr, "  -k, --keepalive   send every request of a connection on one socket,\n");
+  fprintf(stderr, "                    the server needs -k as well. Every line is followed by\n");
+  fprintf(stderr, "                    an AESDCHAR_READFROM past the end, whose empty reply\n");
+  fprintf(stderr, "                    marks where the one to the line ended\n");
+  fprintf(stderr, "  -s, --size        line size including the \\n, default %zu\n", config.line_size);
+  fprintf(stderr, "  -r, --rate        lines per second over all connections, default no limit\n");
+  fprintf(stderr, "  -x, --seeks       percent of requests that are " SEEKTO_CMD " commands,\n");
+  fprintf(stderr, "                    with -k they are sent in front of a line, default 0\n");
+}
+
+static int parse_args(int argc, char *argv[])
+{
+  static const struct option long_options[] = {
+    {"host",   required_argument, NULL, 'H'},
+    {"port",   required_argument, NULL, 'p'},
+    {"connections", required_argument, NULL, 'c'},
+    {"requests", required_argument, NULL, 'n'},
+    {"duration", required_argument, NULL, 'd'},
+    {"keepalive", no_argument,    NULL, 'k'},
+    {"size",   required_argument, NULL, 's'},
+    {"rate",   required_argument, NULL, 'r'},
+    {"seeks",  required_argument, NULL, 'x'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "H:p:c:n:d:ks:r:x:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'H':
+        config.host = optarg;
+        break;
+      case 'p':
+        config.port = optarg;
+        break;
+      case 'c':
+        config.connections = atoi(optarg);
+        if (config.connections < 1) return -1;
+        break;
+      case 'n':
+        config.requests = atol(optarg);
+        if (config.requests < 1) return -1;
+        break;
+      case 'd':
+        config.duration = atoi(optarg);
+        if (config.duration < 1) return -1;
+        break;
+      case 'k':
+        config.persistent = true;
+        break;
+      case 's':
+        config.line_size = atol(optarg);
+        // room for "<id>-<seq> " to keep lines unique
+        if (config.line_size < 24) return -1;
+        break;
+      case 'r':
+        config.rate = atof(optarg);
+        if (config.rate < 0) return -1;
+        break;
+      case 'x':
+        config.seek_percent = atoi(optarg);
+        if (config.seek_percent < 0 || config.seek_percent > 100) return -1;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  int rc;
+
+  if (parse_args(argc, argv) < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  rc = getaddrinfo(config.host, config.port, &hints, &server);
+  if (rc != 0) {
+    fprintf(stderr, "%s:%s: %s\n", config.host, config.port, gai_strerror(rc));
+    return 2;
+  }
+
+  bench_thread_t *threads = calloc(config.connections, sizeof(bench_thread_t));
+  if (NULL == threads) return 2;
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < config.connections; i++) {
+    threads[i].id = i;
+    threads[i].seed = (unsigned int) (start + i);
+    if (pthread_create(&threads[i].pid, NULL, &bench_thread, &threads[i]) != 0) {
+      fprintf(stderr, "Error creating thread %d: %d\n", i, errno);
+      return 2;
+    }
+  }
+
+  size_t count = 0;
+  unsigned long connect_errors = 0, io_errors = 0, bad_replies = 0, seeks = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < config.connections; i++) {
+    pthread_join(threads[i].pid, NULL);
+    count += threads[i].count;
+    connect_errors += threads[i].connect_errors;
+    io_errors += threads[i].io_errors;
+    bad_replies += threads[i].bad_replies;
+    seeks += threads[i].seeks;
+    bytes += threads[i].bytes_received;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  uint64_t *all = malloc((count ? count : 1) * sizeof(uint64_t));
+  if (NULL == all) return 2;
+  size_t n = 0;
+  for (int i = 0; i < config.connections; i++) {
+    // a thread without a completed request never allocated latencies
+    if (threads[i].count > 0) {
+      memcpy(all + n, threads[i].latencies, threads[i].count * sizeof(uint64_t));
+    }
+    n += threads[i].count;
+    free(threads[i].latencies);
+  }
+  qsort(all, count, sizeof(uint64_t), compare_u64);
+
+  printf("%d %s connections, %zu byte lines, %d%% seeks\n", config.connections,
+         config.persistent ? "persistent" : "one-shot", config.line_size, config.seek_percent);
+  printf("requests %zu (%lu seeks) in %.2f s: %.0f req/s, %.1f MB/s received\n",
+         count, seeks, elapsed, count / elapsed, bytes / elapsed / 1e6);
+  if (count > 0) {
+    printf("latency us: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+           percentile(all, count, 0.5) / 1e3, percentile(all, count, 0.99) / 1e3,
+           percentile(all, count, 0.999) / 1e3, all[count - 1] / 1e3);
+  }
+  printf("errors: %lu connect, %lu io, %lu bad replies\n", connect_errors, io_errors, bad_replies);
+
+  free(all);
+  free(threads);
+  freeaddrinfo(server);
+  return (connect_errors || io_errors || bad_replies) ? 1 : 0;
+}
@@ -11,240 +11,1008 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
-#include <stdarg.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include "freebsd_queue.h"
+#include "line_parser.h"
+#include "aesd_log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "async_log.h"
 
-#include "../aesd-char-driver/aesd_ioctl.h"
+volatile sig_atomic_t got_signal = 0;
+int *listenfds = NULL;
+int listen_count = 0;
 
-#define LOG_FILE "/var/tmp/aesdsocketdata"
-#define PORT "9000"
-#define BUFFER_SIZE (1024)
+server_config_t config = {
+  .mode = MODE_POOL,
+  .event_loops = 0,
+  .workers = 16,
+  .queue_depth = 128,
+  .overload = OVERLOAD_CLOSE,
+  .keepalive = false,
+  .batch = 64,
+  .batch_delay = 0,
+  .shards = 1,
+  .backlog = SOMAXCONN,
+  .rcvbuf = 0,
+  .sndbuf = 0,
+  .nodelay = true,
+  .quickack = false,
+  .defer_accept = 0,
+  .fastopen = 0,
+  .busy_poll = 0,
+  .pin = false,
+  .timestamp_interval = 10,
+  .timestamp_format = "timestamp:%a, %d %b %Y %T %z",
+  .metrics_socket = NULL,
+  .output_limit = 1024 * 1024,
+  .slow_client = SLOW_CLIENT_PAUSE,
+  .send_timeout = 30,
+  .handoff_socket = NULL,
+  .drain_timeout = 5,
+  .max_line = 0,
+  .spill = 64 * 1024,
+  .log_rate = 1000,
+  .tail_lag = 1024 * 1024,
+  .tail_policy = TAIL_DROP,
+#if USE_AESD_CHAR_DEVICE
+  .storage = STORAGE_DEVICE,
+#else
+  .storage = STORAGE_FILE,
+#endif
+};
 
-#define DEBUG 0
-#define USE_AESD_CHAR_DEVICE 1
-#define AESD_CHAR_DEVICE "/dev/aesdchar"
+int finish_reply(bool compress, aesd_log_reply_t *reply)
+{
+  if (!compress) return 0;
+  if (aesd_log_reply_compress(reply) < 0) {
+    aesd_log_reply_free(reply);
+    return -1;
+  }
+  return 0;
+}
 
-void FK_DEBUG(const char *fmt, ...)
+// Runs one line: a command, or data appended to the log. Takes the
+// snapshot to answer with.
+int handle_line(const char *line, size_t len, in_addr_t addr, bool *compress,
+                bool event_loop, aesd_log_reply_t *reply)
 {
+  struct aesd_seekto seekto;
+  off_t from;
+  int rc;
 
-  if (DEBUG) {
-    va_list args;
-    va_start(args, fmt);
-    printf(fmt, args);
-    va_end(args);
+  metrics_add(COUNTER_LINES, 1);
+  if (line_too_long(len)) {
+    ALOG(LOG_WARNING, "Dropping a %zu byte line, the limit is %zu", len, config.max_line);
+    return -1;
   }
+  if (parse_seekto(line, len, &seekto)) {
+    FK_DEBUG("GOT COMMAND %u,%u\n", seekto.write_cmd, seekto.write_cmd_offset);
+    rc = aesd_log_snapshot(reply, &seekto);
+  } else if (parse_readfrom(line, len, &from)) {
+    FK_DEBUG("READ FROM %lld\n", (long long) from);
+    rc = aesd_log_snapshot_from(reply, from);
+  } else if (parse_compress(line, len, compress)) {
+    // answered like any other line, already in the new format
+    FK_DEBUG("COMPRESS %d\n", *compress);
+    rc = aesd_log_snapshot(reply, NULL);
+  } else if (!limit_line(addr, len)) {
+    ALOG(LOG_WARNING, "Dropping a %zu byte line, the client is over its rate", len);
+    return -1;
+  } else {
+    FK_DEBUG("Writing %zu bytes\n", len);
+    uint64_t start = metrics_now();
+    if (event_loop) aesd_log_append_direct(line, len);
+    else aesd_log_append(line, len);
+    metrics_since(HIST_INGEST, start);
+    rc = aesd_log_snapshot(reply, NULL);
+  }
+  if (rc < 0) return rc;
+  return finish_reply(*compress, reply);
 }
 
-bool got_signal = false;
-int sockfd;
-
 
 typedef struct slist_data_s slist_data_t;
 struct slist_data_s {
   struct sockaddr_in client_ca;
-  int logfile;
-  pthread_mutex_t *log_mutex;
   int c;
+  uint64_t accepted;
   //pid_t pid;
   pthread_t pid;
-  bool completed;
+  slist_data_t *done_next;  // on the completed stack
 
-  SLIST_ENTRY(slist_data_s) entries;
+  LIST_ENTRY(slist_data_s) entries;
 };
 
-slist_data_t *datap=NULL;
-SLIST_HEAD(slisthead, slist_data_s) head;
+static slab_t thread_slab = SLAB_INITIALIZER("connection threads", sizeof(slist_data_t));
+
+// threads of every shard, guarded by head_lock
+LIST_HEAD(slisthead, slist_data_s) head = LIST_HEAD_INITIALIZER(head);
+static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Finished threads push themselves here and poke reaper_fd, the reaper
+// takes the whole stack at once, so there is no ABA to worry about
+static slist_data_t *completed = NULL;
+static int reaper_fd = -1;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
 
 typedef struct timestamper_data_s timestamper_data_t;
 struct timestamper_data_s {
   pthread_t pid;
-  int logfile;
-  pthread_mutex_t *log_mutex;
 };
 
 
+static void listeners_close(void)
+{
+  for (int i = 0; i < listen_count; i++) {
+    shutdown(listenfds[i], SHUT_RD);
+    shutdown(listenfds[i], SHUT_WR);
+    close(listenfds[i]);
+  }
+}
+
+// Only flags the shutdown, main tears down once its loop returned.
+// Shutting the listeners down wakes every accept loop blocked on them,
+// and shutdown() is async-signal-safe.
 static void sigHandler(int sig)
 {
+  // once handed over the sockets and files belong to the new server,
+  // there is nothing of ours left to clean up
+  if (draining) _exit(EXIT_FAILURE);
+
+  got_signal = 1;
+  for (int i = 0; i < listen_count; i++) shutdown(listenfds[i], SHUT_RDWR);
+}
+
+// Called from main after a signal stopped its accept loop
+static void server_stop(void)
+{
+  slist_data_t *datap;
+
   FK_DEBUG("SIGINT\n");
   syslog(LOG_ERR, "Caught signal, exiting");
-  
-  // close sockets
-  shutdown(sockfd, SHUT_RD);
-  shutdown(sockfd, SHUT_WR);
-  close(sockfd);
 
-#if !USE_AESD_CHAR_DEVICE
-  unlink(LOG_FILE);
-#endif
+  listeners_close();
+  aesd_log_cleanup();
+  metrics_cleanup();
 
-  got_signal = true;
-  
-  // should free all data in linkedlist and stop all threads
-  while (!SLIST_EMPTY(&head)) {
-    datap = SLIST_FIRST(&head);
-    FK_DEBUG("Removing thread: %lu\n", datap->pid);
+  // connection threads of the threads mode, the process is going away
+  // with them, they are not freed
+  pthread_mutex_lock(&head_lock);
+  LIST_FOREACH(datap, &head, entries) {
+    FK_DEBUG("Stopping thread: %lu\n", datap->pid);
     pthread_cancel(datap->pid);
-
-    SLIST_REMOVE_HEAD(&head, entries);
-    free(datap);
   }
+  pthread_mutex_unlock(&head_lock);
+  // whatever the connections logged until now still reaches syslog
+  async_log_flush();
+  closelog();
   _exit(EXIT_FAILURE);
-    
 }
 
+// Appends a timestamp line every config.timestamp_interval seconds. The
+// timerfd fires on a fixed schedule, so slow appends don't make the
+// interval drift, and the line goes through the same (batched) append
+// path as client lines.
 void *timestamper(void *arg) {
-  timestamper_data_t *data = (timestamper_data_t *) arg;
-  struct timespec wanted_sleep;
-  struct timespec remaining_sleep;
-  int wanted_sleep_ms = 10 * 1000;
-  char timestring[100];
+  char timestring[256];
   time_t t;
-  struct tm *tmp;
+  struct tm tm;
+  uint64_t expirations;
+
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0) {
+    syslog(LOG_ERR, "timerfd_create failed: %d", errno);
+    return NULL;
+  }
+  struct itimerspec interval = {
+    .it_interval = { .tv_sec = config.timestamp_interval },
+    .it_value = { .tv_sec = config.timestamp_interval },
+  };
+  if (timerfd_settime(tfd, 0, &interval, NULL) < 0) {
+    syslog(LOG_ERR, "timerfd_settime failed: %d", errno);
+    close(tfd);
+    return NULL;
+  }
 
   while(1){
-    wanted_sleep.tv_sec  = wanted_sleep_ms / 1000;
-    wanted_sleep.tv_nsec = (wanted_sleep_ms % 1000) * 1000000;
-    if (0 != nanosleep(&wanted_sleep, &remaining_sleep)){
-      // did not sleep enough
-    }
-    int res = pthread_mutex_lock(data->log_mutex);
-    FK_DEBUG("mutex_lock: %d\n", res);
-    
-    // should use some error handling here
+    ssize_t n = read(tfd, &expirations, sizeof(expirations));
+    if (n < 0 && errno == EINTR) continue;
+    if (n != sizeof(expirations)) break;
+    if (expirations > 1) FK_DEBUG("Missed %llu timestamps\n", (unsigned long long) expirations - 1);
+
     t = time(NULL);
-    tmp = localtime(&t);
-    strftime(timestring, sizeof(timestring), "timestamp:%a, %d %b %Y %T %z\n", tmp);
-    write(data->logfile, timestring, strlen(timestring));
-    res = pthread_mutex_unlock(data->log_mutex);
-    FK_DEBUG("mutex_unlock: %d\n", res);
+    localtime_r(&t, &tm);
+    size_t len = strftime(timestring, sizeof(timestring) - 1, config.timestamp_format, &tm);
+    timestring[len++] = '\n';
+    aesd_log_append(timestring, len);
   }
+  close(tfd);
+  return NULL;
 }
 
-void *connection_thread(void *arg)
+// Sends a whole log snapshot on a blocking socket. No lock is held,
+// writers keep appending meanwhile.
+static ssize_t send_reply(int c, aesd_log_reply_t *reply)
 {
-  bool seeked = false;
-  slist_data_t *data = (slist_data_t *) arg;
-  char *client_ip = inet_ntoa(data->client_ca.sin_addr);
-  syslog(LOG_DAEMON, "Accepted connection from %s", client_ip);
-  
-  unsigned long totalbytes=0;
-  // read messages separated by \n until \0 is received
+  ssize_t total = 0;
+
+  while (!aesd_log_reply_done(reply)) {
+    ssize_t n = aesd_log_reply_send(c, reply);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ALOG(LOG_WARNING, "Send timed out, client is not reading");
+    }
+    if (n < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+      FK_DEBUG("Client hung up before the end of its reply\n");
+    }
+    if (n <= 0) return -1;
+    total += n;
+  }
+  return total;
+}
+
+// Appends one line (or runs a command) and sends the log back.
+// Returns -1 when the reply could not be sent.
+static int serve_line(int c, const char *line, size_t len, in_addr_t addr, bool *compress)
+{
+  aesd_log_reply_t reply;
+
+  if (handle_line(line, len, addr, compress, false, &reply) < 0) return -1;
+  ssize_t sent = send_reply(c, &reply);
+  if (sent >= 0) aesd_log_reply_sent(&reply);
+  aesd_log_reply_free(&reply);
+  FK_DEBUG("Sent %ld bytes\n", (long) sent);
+  return sent < 0 ? -1 : 0;
+}
+
+// Anonymous file for a long line, gone as soon as it is closed
+static int staging_open(void)
+{
+  int fd = open(SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+
+  // no O_TMPFILE on this file system
+  char path[] = SPILL_DIR "/aesdsocket-line.XXXXXX";
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd >= 0) unlink(path);
+  return fd;
+}
+
+// Moves the rest of a long line from the socket into staging with
+// splice(). The data never passes through userspace, only a peek at it
+// to find the \n. staged is the length so far and is updated.
+// Returns 1 once the line is complete, 0 when the client stopped sending
+// before its end and -1 on errors or when it got too long.
+static int spill_line(int c, int staging, size_t *staged)
+{
+  char scan[BUFFER_SIZE * 16];
+  int pipefd[2];
+  int rc = -1;
+
+  if (pipe2(pipefd, O_CLOEXEC) < 0) return -1;
+  while (1) {
+    ssize_t n = recv(c, scan, sizeof(scan), MSG_PEEK);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      rc = (n == 0) ? 0 : -1;
+      break;
+    }
+    char *nl = memchr(scan, '\n', n);
+    size_t take = (NULL != nl) ? (size_t) (nl - scan + 1) : (size_t) n;
+    if (line_too_long(*staged + take + (NULL == nl))) {
+      ALOG(LOG_WARNING, "Dropping a line of more than %zu bytes", config.max_line);
+      break;
+    }
+
+    // socket -> pipe -> staging, a pipe holds less than we peeked
+    size_t moved = 0;
+    while (moved < take) {
+      ssize_t in = splice(c, NULL, pipefd[1], NULL, take - moved, SPLICE_F_MOVE);
+      if (in < 0 && errno == EINTR) continue;
+      if (in <= 0) goto DONE;
+      while (in > 0) {
+        loff_t off = *staged + moved;
+        ssize_t out = splice(pipefd[0], NULL, staging, &off, in, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR) continue;
+        if (out <= 0) goto DONE;
+        in -= out;
+        moved += out;
+      }
+    }
+    *staged += take;
+    metrics_add(COUNTER_BYTES_IN, take);
+    if (NULL != nl) {
+      rc = 1;
+      break;
+    }
+  }
+
+DONE:
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return rc;
+}
+
+// Takes over a partial line that reached config.spill bytes: what the
+// parser holds goes to a staging file, the rest follows with splice() and
+// the complete line is appended from there. Nothing is held while the
+// line arrives, the log only sees it once it is complete.
+// Returns -1 when the connection should be closed.
+static int serve_spilled_line(int c, line_parser_t *parser, in_addr_t addr, bool *compress)
+{
+  size_t staged;
+  const char *partial = line_parser_pending(parser, &staged);
+  int rc = -1;
+
+  int staging = staging_open();
+  if (staging < 0) {
+    syslog(LOG_ERR, "Error creating staging file: %d", errno);
+    return -1;
+  }
+  size_t written = 0;
+  while (written < staged) {
+    ssize_t n = write(staging, partial + written, staged - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) goto CLOSE;
+    written += n;
+  }
+  // drops the staged bytes and gives a grown buffer back
+  line_parser_free(parser);
+  line_parser_init(parser);
+
+  int complete = spill_line(c, staging, &staged);
+  if (complete < 0) goto CLOSE;
+  FK_DEBUG("Writing %zu staged bytes\n", staged);
+  metrics_add(COUNTER_LINES, 1);
+  if (!limit_line(addr, staged)) {
+    ALOG(LOG_WARNING, "Dropping a %zu byte line, the client is over its rate", staged);
+    goto CLOSE;
+  }
+  uint64_t start = metrics_now();
+  aesd_log_append_fd(staging, staged);
+  metrics_since(HIST_INGEST, start);
+  if (!complete) goto CLOSE;  // kept like any partial line, no reply
+
+  aesd_log_reply_t reply;
+  if (aesd_log_snapshot(&reply, NULL) < 0 || finish_reply(*compress, &reply) < 0) goto CLOSE;
+  ssize_t sent = send_reply(c, &reply);
+  if (sent >= 0) aesd_log_reply_sent(&reply);
+  aesd_log_reply_free(&reply);
+  if (sent >= 0 && config.keepalive) rc = 0;
+
+CLOSE:
+  close(staging);
+  return rc;
+}
+
+// Serves one client on a blocking socket: every line is appended to the
+// log and answered with the log. Without keepalive the connection is
+// closed after the first reply. Used by the per-connection threads and
+// the worker pool.
+void serve_connection(int c, const struct sockaddr_in *client_ca, uint64_t accepted)
+{
+  line_parser_t parser;
+  bool compress = false;
+  // staged lines are copied in the kernel into the log file, other
+  // backends would only read them back into memory
+  bool spill = config.spill > 0 && NULL != aesd_log_backend()->write_at && aesd_log_fd() >= 0;
+  char client_ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &client_ca->sin_addr, client_ip, sizeof(client_ip));
+  ALOG(LOG_DAEMON | LOG_INFO, "Accepted connection from %s", client_ip);
+
+  // a client that stops reading would hold this thread forever
+  if (config.send_timeout > 0) {
+    struct timeval timeout = { .tv_sec = config.send_timeout };
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  line_parser_init(&parser);
   while (1) {
-    char *buffer = malloc(BUFFER_SIZE);
-    //if (NULL == buffer) goto ERR_BUFFER_ALLOCATION;
+    size_t avail;
+    char *buffer = line_parser_space(&parser, BUFFER_SIZE, &avail);
+    if (NULL == buffer) break;
+
     FK_DEBUG("Waiting for data\n");
-    
-    // wait for data or 10second timeout
-    int bytes_read = recv(data->c, buffer, BUFFER_SIZE, 0);
-    if (bytes_read < 1){
+    ssize_t bytes_read = recv(c, buffer, avail, 0);
+    if (bytes_read < 1) {
+      // client went away in the middle of a line, keep what we got
       FK_DEBUG("socket failure: %d\n", errno);
-      free(buffer);
-      data->completed = true;
-      return NULL;
+      size_t pending;
+      const char *partial = line_parser_pending(&parser, &pending);
+      if (pending > 0) aesd_log_append(partial, pending);
+      break;
     }
-    totalbytes += bytes_read;
-    
-    // check if message contains \n
-    char *nn = strchr(buffer, '\n');
-    // if also end of all messages
-    FK_DEBUG("Got %d bytes\n", bytes_read);
-    
-    // get mutex here
-    int res = pthread_mutex_lock(data->log_mutex);
-    FK_DEBUG("mutex_lock: %d\n", res);
-
-    if (NULL != nn ) {
-      int to_write = (nn-buffer);
-      // check if ioctl command in stream
-      if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 19)==0){
-        FK_DEBUG("GOT COMMAND\n\t");
-        FK_DEBUG(buffer+19);
-        FK_DEBUG("\n\n");
-
-        
-        struct aesd_seekto seekto;
-        char *tok = strtok(buffer+19, ",");
-        seekto.write_cmd = atoi(tok);
-        tok=strtok(NULL, ",");
-        seekto.write_cmd_offset = atoi(tok);
-        ioctl(data->logfile, AESDCHAR_IOCSEEKTO, (unsigned long) &seekto);
-        seeked = true;
-      } else {
-        FK_DEBUG("Writing %d bytes\n", to_write);
-        int written = write(data->logfile, buffer, to_write);
-        if (written < 0){
-          FK_DEBUG("\tfailed: %d\n", errno);
-        }
-        FK_DEBUG("\tComplete message len: %d wrote: %d\n", to_write, written);
-
-        buffer[0] = '\n';
-        written = write(data->logfile, buffer, 1);
+    FK_DEBUG("Got %zd bytes\n", bytes_read);
+    if (accepted != 0) {
+      metrics_since(HIST_FIRST_BYTE, accepted);
+      accepted = 0;
+    }
+    metrics_add(COUNTER_BYTES_IN, bytes_read);
+    line_parser_commit(&parser, bytes_read);
 
+    // every complete line gets its own reply, in order
+    const char *line;
+    size_t len;
+    while ((line = line_parser_next(&parser, &len)) != NULL) {
+      if (parse_subscribe(line, len)) {
+        // anything pipelined behind it is dropped, c is the tail's now
+        metrics_add(COUNTER_LINES, 1);
+        if (tail_subscribe(c, client_ip) < 0) goto CLOSE;
+        line_parser_free(&parser);
+        metrics_connection(-1);
+        return;
       }
+      if (serve_line(c, line, len, client_ca->sin_addr.s_addr, &compress) < 0) goto CLOSE;
+      if (!config.keepalive) goto CLOSE;
+    }
 
-      free(buffer);
-      FK_DEBUG("unlocking mutex\n");
-      res=pthread_mutex_unlock(data->log_mutex);
-      FK_DEBUG("mutex_unlock: %d\n", res);
-      break;
-    } else {
-      FK_DEBUG("No complete message yet, (writing %d to log)\n", bytes_read);
-      write(data->logfile, buffer, bytes_read);
-      free(buffer);
+    size_t pending;
+    line_parser_pending(&parser, &pending);
+    // the \n is still to come
+    if (line_too_long(pending + 1)) {
+      ALOG(LOG_WARNING, "Dropping a line of more than %zu bytes", config.max_line);
+      goto CLOSE;
+    }
+    if (spill && pending >= config.spill) {
+      if (serve_spilled_line(c, &parser, client_ca->sin_addr.s_addr, &compress) < 0) goto CLOSE;
+    }
+  }
 
-      FK_DEBUG("unlocking mutex\n");
-      res=pthread_mutex_unlock(data->log_mutex);
-      FK_DEBUG("mutex_unlock: %d\n", res);
+CLOSE:
+  line_parser_free(&parser);
+  close(c);
+  metrics_connection(-1);
+  ALOG(LOG_DAEMON | LOG_INFO, "Closed connection from %s", client_ip);
+}
 
+void *connection_thread(void *arg)
+{
+  slist_data_t *data = (slist_data_t *) arg;
+  uint64_t one = 1;
+
+  serve_connection(data->c, &data->client_ca, data->accepted);
+
+  // data stays ours until the reaper joined us
+  data->done_next = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&completed, &data->done_next, data, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  if (write(reaper_fd, &one, sizeof(one)) < 0) FK_DEBUG("Waking reaper failed: %d\n", errno);
+  pthread_exit(NULL);
+}
+
+// Joins finished connection threads as they complete, without looking
+// at the live ones
+static void *reaper(void *arg)
+{
+  uint64_t count;
+
+  while (1) {
+    ssize_t n = read(reaper_fd, &count, sizeof(count));
+    if (n < 0 && errno == EINTR) continue;
+    if (n != sizeof(count)) break;
+
+    slist_data_t *datap = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+    while (NULL != datap) {
+      slist_data_t *next = datap->done_next;
+      // off the list before the join, a listed thread can be cancelled
+      pthread_mutex_lock(&head_lock);
+      LIST_REMOVE(datap, entries);
+      pthread_mutex_unlock(&head_lock);
+      pthread_join(datap->pid, NULL);
+      FK_DEBUG("Removing thread: %lu\n", datap->pid);
+      slab_put(&thread_slab, datap);
+      datap = next;
+    }
+  }
+  syslog(LOG_ERR, "Reaper stopped: %d", errno);
+  return NULL;
+}
+
+static void reaper_start(void)
+{
+  pthread_t pid;
+
+  reaper_fd = eventfd(0, EFD_CLOEXEC);
+  if (reaper_fd < 0 || pthread_create(&pid, NULL, &reaper, NULL) != 0) {
+    syslog(LOG_ERR, "Error starting the reaper: %d", errno);
+    if (reaper_fd >= 0) close(reaper_fd);
+    reaper_fd = -1;
+    return;
+  }
+  pthread_detach(pid);
+}
+
+// Original thread per connection server, only returns on errors or
+// with 0 after a handoff
+static int threads_server_run(int listenfd)
+{
+  slist_data_t *datap;
+
+  // one reaper for the threads of every shard
+  pthread_once(&reaper_once, &reaper_start);
+  if (reaper_fd < 0) return -1;
+
+  accept_loop_enter();
+  while (1){
+    datap = slab_get(&thread_slab);
+    if (NULL == datap) return -1;
+
+    int len_client_ca = sizeof(struct sockaddr_in);
+    if ( (datap->c = accept4(listenfd, (struct sockaddr *) &datap->client_ca, (socklen_t *)&len_client_ca, SOCK_CLOEXEC)) < 0) {
+      slab_put(&thread_slab, datap);
+      if (draining) {
+        // connection threads finish on their own
+        accept_loop_leave();
+        return 0;
+      }
+      // failed accepting socket
+      FK_DEBUG("Timed out accepting: %d\n", errno);
+      return 5;
+    }
+    if (!limit_accept(datap->client_ca.sin_addr.s_addr)) {
+      ALOG(LOG_DAEMON | LOG_INFO, "Refusing a connection, the client is over its rate");
+      close(datap->c);
+      slab_put(&thread_slab, datap);
+      continue;
     }
-    //free(buffer);
-    // give mutex here
-    FK_DEBUG("unlocking mutex\n");
-    res=pthread_mutex_unlock(data->log_mutex);
-    FK_DEBUG("mutex_unlock: %d\n", res);
+    datap->accepted = metrics_now();
+    // counted from here so a handoff waits for it
+    metrics_connection(1);
+    conn_tune(datap->c);
+    // listed before it starts, the reaper may get it right away
+    pthread_mutex_lock(&head_lock);
+    LIST_INSERT_HEAD(&head, datap, entries);
+    pthread_mutex_unlock(&head_lock);
+    // do the fork dance here
+    int rr = pthread_create(&datap->pid, NULL, &connection_thread, (void *) datap);
+    if (rr != 0) {
+      syslog(LOG_ERR, "Error creating connection thread: %d", rr);
+      pthread_mutex_lock(&head_lock);
+      LIST_REMOVE(datap, entries);
+      pthread_mutex_unlock(&head_lock);
+      close(datap->c);
+      metrics_connection(-1);
+      slab_put(&thread_slab, datap);
+    }
+  } // while(1)
+}
+
+// Serves one listening socket with the configured mode.
+// Only returns on errors, or with 0 once a handoff stopped it.
+static int shard_run(int listenfd)
+{
+  enum server_mode mode = config.mode;
 
+  if (mode == MODE_URING) {
+    int rc = uring_server_run(listenfd, config.event_loops);
+    if (rc != 1) return rc;
+    syslog(LOG_WARNING, "Falling back to the worker pool");
+    mode = MODE_POOL;
+  }
+  if (mode == MODE_EPOLL) {
+    int rc = epoll_server_run(listenfd, config.event_loops);
+    if (rc != 1) return rc;
+    syslog(LOG_WARNING, "Falling back to the worker pool");
+    mode = MODE_POOL;
+  }
+  switch (mode) {
+    case MODE_POOL:
+      return pool_server_run(listenfd, config.workers, config.queue_depth);
+    default:
+      return threads_server_run(listenfd);
   }
+}
+
+typedef struct shard_s shard_t;
+struct shard_s {
+  pthread_t pid;
+  int index;
+};
+
+// Threads started by the shard inherit its CPU
+static void shard_pin(int index)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) return;
 
-  FK_DEBUG("Send data to socket\n");
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(index % cpus, &set);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) syslog(LOG_WARNING, "Pinning shard %d failed: %d", index, rc);
+}
 
-  // get mutex again
-  int res=pthread_mutex_lock(data->log_mutex);
-  FK_DEBUG("mutex_lock: %d\n", res);
+static void *shard_thread(void *arg)
+{
+  shard_t *shard = (shard_t *) arg;
 
+  if (config.pin) shard_pin(shard->index);
+  int rc = shard_run(listenfds[shard->index]);
+  if (!draining && !got_signal) syslog(LOG_ERR, "Shard %d stopped: %d", shard->index, rc);
+  return NULL;
+}
 
-  // seek to beginning of file if we don't have seeked
-  // with command in stream
-  if(!seeked) lseek(data->logfile, 0, SEEK_SET);
+// Creates a socket bound to the server address. With SO_REUSEPORT every
+// shard binds its own and the kernel spreads new connections over them.
+static int listener_open(const struct addrinfo *ai, bool reuseport)
+{
+  int on = 1;
 
-  char *wrbuffer = (char*) malloc(BUFFER_SIZE);
-  if (NULL==wrbuffer) return NULL; //goto ERR_BUFFER_ALLOCATION;
-  size_t readbytes=0;
-  FK_DEBUG("Sending bytes\n");
-  size_t this_read = read(data->logfile, wrbuffer, BUFFER_SIZE);
-  while(this_read > 0) {
-    FK_DEBUG("Sending %ld bytes total sent: %ld\n", this_read, readbytes+this_read);
-    send(data->c, (void *)wrbuffer, this_read, 0);
-    readbytes += this_read;
-    this_read = read(data->logfile, wrbuffer, BUFFER_SIZE);
+  int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Error creating socket");
+    return -1;
   }
-  
-  free(wrbuffer);
-  // give back mutex
-  res = pthread_mutex_unlock(data->log_mutex);
-  FK_DEBUG("mutex_unlock: %d\n", res);
-
-  close(data->c);
-  syslog(LOG_DAEMON, "Closed connection from %s", client_ip);
-  data->completed = true;
-  pthread_exit(NULL);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+    FK_DEBUG("setsockopt failed: %d\n", errno);
+  }
+  listener_tune(fd);
+
+  FK_DEBUG("binding socket\n");
+  if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-d] [-m pool|threads|epoll|uring] [-l loops] [-w workers] [-q depth] [-o close|wait] [-k] [-s file|mmap|device|ring] [-b lines] [-D usec]\n"
+          "       [-S shards] [-B backlog] [-P] [-T seconds] [-F format] [-M path]\n"
+          "       [-O bytes] [-C pause|close] [-t seconds] [-L bytes] [-H path] [socket tuning]\n", name);
+  fprintf(stderr, "  -d              run as a daemon\n");
+  fprintf(stderr, "  -m, --mode      connection handling, default pool. epoll and uring fall\n");
+  fprintf(stderr, "                  back to pool with the device, its writes block\n");
+  fprintf(stderr, "  -l, --loops     number of epoll loops or io_uring rings, default one per CPU\n");
+  fprintf(stderr, "  -w, --workers   pool worker threads, default 16\n");
+  fprintf(stderr, "  -q, --queue     pool accept queue depth, default 128\n");
+  fprintf(stderr, "  -o, --overload  when the pool queue is full: close (default) or wait\n");
+  fprintf(stderr, "  -k, --keepalive keep connections open and answer every line\n");
+  fprintf(stderr, "  -s, --storage   log in " LOG_FILE " (file, or mmap to map it), " AESD_CHAR_DEVICE "\n");
+  fprintf(stderr, "                  or an in-process ring with the same semantics, default %s\n",
+          USE_AESD_CHAR_DEVICE ? "device" : "file");
+  fprintf(stderr, "  -b, --batch     lines written together by the group commit, 1 disables\n");
+  fprintf(stderr, "                  it, default 64. epoll and uring don't wait for batches\n");
+  fprintf(stderr, "  -D, --batch-delay\n");
+  fprintf(stderr, "                  microseconds to wait for a full batch, default 0\n");
+  fprintf(stderr, "  -S, --shards    SO_REUSEPORT listeners with their own accept loop and\n");
+  fprintf(stderr, "                  connection handling, 0 for one per CPU, default 1\n");
+  fprintf(stderr, "  -B, --backlog   listen backlog of every shard, default %d\n", SOMAXCONN);
+  fprintf(stderr, "  -P, --pin       pin each shard and its threads to a CPU\n");
+  fprintf(stderr, "  -T, --timestamp-interval\n");
+  fprintf(stderr, "                  seconds between timestamp lines in the log file, 0 for\n");
+  fprintf(stderr, "                  none, default 10\n");
+  fprintf(stderr, "  -F, --timestamp-format\n");
+  fprintf(stderr, "                  strftime() format of the timestamp lines, default\n");
+  fprintf(stderr, "                  \"%s\"\n", config.timestamp_format);
+  fprintf(stderr, "  -M, --metrics-socket\n");
+  fprintf(stderr, "                  UNIX socket that answers every connection with the\n");
+  fprintf(stderr, "                  metrics, SIGUSR1 logs them either way\n");
+  fprintf(stderr, "  -O, --output-limit\n");
+  fprintf(stderr, "                  bytes of replies an epoll connection may queue, default\n");
+  fprintf(stderr, "                  %zu\n", config.output_limit);
+  fprintf(stderr, "  -C, --slow-client\n");
+  fprintf(stderr, "                  when the limit is reached: pause (default) to stop\n");
+  fprintf(stderr, "                  answering its lines until it reads, or close\n");
+  fprintf(stderr, "  -t, --send-timeout\n");
+  fprintf(stderr, "                  seconds the thread and pool modes wait on a client that\n");
+  fprintf(stderr, "                  doesn't read before closing it, 0 for no limit, default %d\n",
+          config.send_timeout);
+  fprintf(stderr, "  -L, --max-line  longest line in bytes, longer ones close the connection,\n");
+  fprintf(stderr, "                  0 for no limit (default)\n");
+  fprintf(stderr, "  --spill bytes   the thread and pool modes stream partial lines this long\n");
+  fprintf(stderr, "                  through a staging file in " SPILL_DIR " into the log file\n");
+  fprintf(stderr, "                  with splice(), 0 keeps them in memory, default %zu\n", config.spill);
+  fprintf(stderr, "  --log-rate n    connection messages per second passed on to syslog,\n");
+  fprintf(stderr, "                  the rest are counted and dropped, 0 for no limit,\n");
+  fprintf(stderr, "                  default %d\n", config.log_rate);
+  fprintf(stderr, "  --tail-lag bytes\n");
+  fprintf(stderr, "                  what a connection that sent " SUBSCRIBE_CMD " may fall\n");
+  fprintf(stderr, "                  behind the log, 0 for no limit, default %zu\n", config.tail_lag);
+  fprintf(stderr, "  --tail-policy drop|close\n");
+  fprintf(stderr, "                  drop (default) skips the oldest appends it has not been\n");
+  fprintf(stderr, "                  sent, close disconnects it\n");
+  fprintf(stderr, "  --client-conns n, --client-lines n, --client-bytes n\n");
+  fprintf(stderr, "                  connections, lines and line bytes per second one client\n");
+  fprintf(stderr, "                  address may send, with a burst of one second. Connections\n");
+  fprintf(stderr, "                  over it are closed right away, a line over it closes its\n");
+  fprintf(stderr, "                  connection unlogged. 0 for no limit (default)\n");
+  fprintf(stderr, "  --global-conns n, --global-lines n, --global-bytes n\n");
+  fprintf(stderr, "                  the same for all clients together\n");
+  fprintf(stderr, "  -H, --handoff   UNIX socket for hot restarts: a server started with the\n");
+  fprintf(stderr, "                  path of a running one takes over its listeners and log,\n");
+  fprintf(stderr, "                  the old one drains its connections and exits. The new\n");
+  fprintf(stderr, "                  one opens the log where the old one sealed it, until then\n");
+  fprintf(stderr, "                  new connections wait in the backlog. Not with -s ring,\n");
+  fprintf(stderr, "                  its log only lives in the process\n");
+  fprintf(stderr, "  --drain-timeout seconds\n");
+  fprintf(stderr, "                  how long connections get to finish after a handoff, and\n");
+  fprintf(stderr, "                  so the longest the new server may stall, default %d\n",
+          config.drain_timeout);
+  fprintf(stderr, "Socket tuning, 0 keeps the kernel default:\n");
+  fprintf(stderr, "  --rcvbuf bytes, --sndbuf bytes\n");
+  fprintf(stderr, "                  SO_RCVBUF and SO_SNDBUF of the listeners, inherited by\n");
+  fprintf(stderr, "                  accepted sockets\n");
+  fprintf(stderr, "  --nodelay 0|1   TCP_NODELAY on accepted sockets, default 1\n");
+  fprintf(stderr, "  --quickack 0|1  TCP_QUICKACK on accepted sockets, default 0\n");
+  fprintf(stderr, "  --defer-accept seconds\n");
+  fprintf(stderr, "                  TCP_DEFER_ACCEPT, wake accept() only once data arrived\n");
+  fprintf(stderr, "  --fastopen queue\n");
+  fprintf(stderr, "                  TCP_FASTOPEN queue length\n");
+  fprintf(stderr, "  --busy-poll usec\n");
+  fprintf(stderr, "                  SO_BUSY_POLL, spin on the device queue instead of sleeping\n");
+  fprintf(stderr, "  --profile default|low-latency\n");
+  fprintf(stderr, "                  low-latency sets quickack, defer-accept 1 and busy-poll 50,\n");
+  fprintf(stderr, "                  options after it still apply\n");
 }
 
+// long options without a short one
+enum {
+  OPT_RCVBUF = 256,
+  OPT_SNDBUF,
+  OPT_NODELAY,
+  OPT_QUICKACK,
+  OPT_DEFER_ACCEPT,
+  OPT_FASTOPEN,
+  OPT_BUSY_POLL,
+  OPT_PROFILE,
+  OPT_DRAIN_TIMEOUT,
+  OPT_SPILL,
+  OPT_LOG_RATE,
+  OPT_TAIL_LAG,
+  OPT_TAIL_POLICY,
+  OPT_CLIENT_CONNS,
+  OPT_CLIENT_LINES,
+  OPT_CLIENT_BYTES,
+  OPT_GLOBAL_CONNS,
+  OPT_GLOBAL_LINES,
+  OPT_GLOBAL_BYTES,
+};
+
+static int parse_args(int argc, char *argv[], bool *daemonize)
+{
+  static const struct option long_options[] = {
+    {"daemon", no_argument,       NULL, 'd'},
+    {"mode",   required_argument, NULL, 'm'},
+    {"loops",  required_argument, NULL, 'l'},
+    {"workers", required_argument, NULL, 'w'},
+    {"queue",  required_argument, NULL, 'q'},
+    {"overload", required_argument, NULL, 'o'},
+    {"keepalive", no_argument,    NULL, 'k'},
+    {"storage", required_argument, NULL, 's'},
+    {"batch",  required_argument, NULL, 'b'},
+    {"batch-delay", required_argument, NULL, 'D'},
+    {"shards", required_argument, NULL, 'S'},
+    {"backlog", required_argument, NULL, 'B'},
+    {"pin",    no_argument,       NULL, 'P'},
+    {"timestamp-interval", required_argument, NULL, 'T'},
+    {"timestamp-format", required_argument, NULL, 'F'},
+    {"metrics-socket", required_argument, NULL, 'M'},
+    {"output-limit", required_argument, NULL, 'O'},
+    {"slow-client", required_argument, NULL, 'C'},
+    {"send-timeout", required_argument, NULL, 't'},
+    {"max-line", required_argument, NULL, 'L'},
+    {"spill", required_argument, NULL, OPT_SPILL},
+    {"log-rate", required_argument, NULL, OPT_LOG_RATE},
+    {"tail-lag", required_argument, NULL, OPT_TAIL_LAG},
+    {"tail-policy", required_argument, NULL, OPT_TAIL_POLICY},
+    {"client-conns", required_argument, NULL, OPT_CLIENT_CONNS},
+    {"client-lines", required_argument, NULL, OPT_CLIENT_LINES},
+    {"client-bytes", required_argument, NULL, OPT_CLIENT_BYTES},
+    {"global-conns", required_argument, NULL, OPT_GLOBAL_CONNS},
+    {"global-lines", required_argument, NULL, OPT_GLOBAL_LINES},
+    {"global-bytes", required_argument, NULL, OPT_GLOBAL_BYTES},
+    {"handoff", required_argument, NULL, 'H'},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+    {"sndbuf", required_argument, NULL, OPT_SNDBUF},
+    {"nodelay", required_argument, NULL, OPT_NODELAY},
+    {"quickack", required_argument, NULL, OPT_QUICKACK},
+    {"defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT},
+    {"fastopen", required_argument, NULL, OPT_FASTOPEN},
+    {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+    {"profile", required_argument, NULL, OPT_PROFILE},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "dm:l:w:q:o:ks:b:D:S:B:PT:F:M:O:C:t:L:H:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'd':
+        *daemonize = true;
+        break;
+      case 'm':
+        if (strcmp(optarg, "threads") == 0) config.mode = MODE_THREADS;
+        else if (strcmp(optarg, "pool") == 0) config.mode = MODE_POOL;
+        else if (strcmp(optarg, "epoll") == 0) config.mode = MODE_EPOLL;
+        else if (strcmp(optarg, "uring") == 0) config.mode = MODE_URING;
+        else return -1;
+        break;
+      case 'l':
+        config.event_loops = atoi(optarg);
+        if (config.event_loops < 1) return -1;
+        break;
+      case 'w':
+        config.workers = atoi(optarg);
+        if (config.workers < 1) return -1;
+        break;
+      case 'q':
+        config.queue_depth = atoi(optarg);
+        if (config.queue_depth < 1) return -1;
+        break;
+      case 'k':
+        config.keepalive = true;
+        break;
+      case 'o':
+        if (strcmp(optarg, "close") == 0) config.overload = OVERLOAD_CLOSE;
+        else if (strcmp(optarg, "wait") == 0) config.overload = OVERLOAD_WAIT;
+        else return -1;
+        break;
+      case 's':
+        if (strcmp(optarg, "file") == 0) config.storage = STORAGE_FILE;
+        else if (strcmp(optarg, "mmap") == 0) config.storage = STORAGE_MMAP;
+        else if (strcmp(optarg, "device") == 0) config.storage = STORAGE_DEVICE;
+        else if (strcmp(optarg, "ring") == 0) config.storage = STORAGE_RING;
+        else return -1;
+        break;
+      case 'b':
+        config.batch = atoi(optarg);
+        if (config.batch < 1) return -1;
+        break;
+      case 'D':
+        config.batch_delay = atol(optarg);
+        if (config.batch_delay < 0) return -1;
+        break;
+      case 'S':
+        config.shards = atoi(optarg);
+        if (config.shards < 0) return -1;
+        break;
+      case 'B':
+        config.backlog = atoi(optarg);
+        if (config.backlog < 1) return -1;
+        break;
+      case 'P':
+        config.pin = true;
+        break;
+      case 'T':
+        config.timestamp_interval = atoi(optarg);
+        if (config.timestamp_interval < 0) return -1;
+        break;
+      case 'F':
+        config.timestamp_format = optarg;
+        break;
+      case 'M':
+        config.metrics_socket = optarg;
+        break;
+      case 'O':
+        config.output_limit = strtoul(optarg, NULL, 10);
+        if (config.output_limit < 1) return -1;
+        break;
+      case 'C':
+        if (strcmp(optarg, "pause") == 0) config.slow_client = SLOW_CLIENT_PAUSE;
+        else if (strcmp(optarg, "close") == 0) config.slow_client = SLOW_CLIENT_CLOSE;
+        else return -1;
+        break;
+      case 't':
+        config.send_timeout = atoi(optarg);
+        if (config.send_timeout < 0) return -1;
+        break;
+      case 'L':
+        config.max_line = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_SPILL:
+        config.spill = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_LOG_RATE:
+        config.log_rate = atoi(optarg);
+        if (config.log_rate < 0) return -1;
+        break;
+      case OPT_TAIL_LAG:
+        config.tail_lag = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_TAIL_POLICY:
+        if (strcmp(optarg, "drop") == 0) config.tail_policy = TAIL_DROP;
+        else if (strcmp(optarg, "close") == 0) config.tail_policy = TAIL_CLOSE;
+        else return -1;
+        break;
+      case OPT_CLIENT_CONNS:
+        config.client_conns = atoi(optarg);
+        if (config.client_conns < 0) return -1;
+        break;
+      case OPT_CLIENT_LINES:
+        config.client_lines = atoi(optarg);
+        if (config.client_lines < 0) return -1;
+        break;
+      case OPT_CLIENT_BYTES:
+        config.client_bytes = atoi(optarg);
+        if (config.client_bytes < 0) return -1;
+        break;
+      case OPT_GLOBAL_CONNS:
+        config.global_conns = atoi(optarg);
+        if (config.global_conns < 0) return -1;
+        break;
+      case OPT_GLOBAL_LINES:
+        config.global_lines = atoi(optarg);
+        if (config.global_lines < 0) return -1;
+        break;
+      case OPT_GLOBAL_BYTES:
+        config.global_bytes = atoi(optarg);
+        if (config.global_bytes < 0) return -1;
+        break;
+      case 'H':
+        config.handoff_socket = optarg;
+        break;
+      case OPT_DRAIN_TIMEOUT:
+        config.drain_timeout = atoi(optarg);
+        if (config.drain_timeout < 0) return -1;
+        break;
+      case OPT_RCVBUF:
+        config.rcvbuf = atoi(optarg);
+        if (config.rcvbuf < 0) return -1;
+        break;
+      case OPT_SNDBUF:
+        config.sndbuf = atoi(optarg);
+        if (config.sndbuf < 0) return -1;
+        break;
+      case OPT_NODELAY:
+        config.nodelay = atoi(optarg) != 0;
+        break;
+      case OPT_QUICKACK:
+        config.quickack = atoi(optarg) != 0;
+        break;
+      case OPT_DEFER_ACCEPT:
+        config.defer_accept = atoi(optarg);
+        if (config.defer_accept < 0) return -1;
+        break;
+      case OPT_FASTOPEN:
+        config.fastopen = atoi(optarg);
+        if (config.fastopen < 0) return -1;
+        break;
+      case OPT_BUSY_POLL:
+        config.busy_poll = atoi(optarg);
+        if (config.busy_poll < 0) return -1;
+        break;
+      case OPT_PROFILE:
+        if (strcmp(optarg, "low-latency") == 0) {
+          config.quickack = true;
+          config.defer_accept = 1;
+          config.busy_poll = 50;
+        } else if (strcmp(optarg, "default") != 0) {
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+  // the ring lives in the process, a new server would start it empty
+  if (NULL != config.handoff_socket && config.storage == STORAGE_RING) return -1;
+  return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    bool daemonize = false;
+
     openlog("AESDSOCKET", 0, LOG_USER);
-   
+    if (parse_args(argc, argv, &daemonize) < 0) {
+      usage(argv[0]);
+      closelog();
+      return -1;
+    }
+
 
     // making socket to listen on
     struct addrinfo hints;
@@ -259,133 +1027,124 @@ int main(int argc, char *argv[])
     FK_DEBUG("getaddrinfo\n");
     if (0 != getaddrinfo(NULL, PORT, &hints, &servinfo) ) goto ERR_GETADDRINFO;
 
-    FK_DEBUG("creating socket\n");
-    sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (0 == sockfd) goto ERR_SOCKET;
-      
-    // Enable reuseaddr
-    int on = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
-
-    FK_DEBUG("binding socket\n");
-    int sock = bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (0 != sock) goto ERR_BIND;
+    // a running server hands its listeners over, the port stays open
+    int handed_over = 0;
+    if (NULL != config.handoff_socket) {
+      handed_over = handoff_receive(config.handoff_socket);
+      if (handed_over < 0) goto ERR_BIND;
+    }
+    if (handed_over) {
+      config.shards = listen_count;
+    } else {
+      if (config.shards == 0) config.shards = sysconf(_SC_NPROCESSORS_ONLN);
+      if (config.shards < 1) config.shards = 1;
+      listenfds = calloc(config.shards, sizeof(int));
+      if (NULL == listenfds) goto ERR_BIND;
+      FK_DEBUG("creating sockets\n");
+      for (listen_count = 0; listen_count < config.shards; listen_count++) {
+        listenfds[listen_count] = listener_open(servinfo, config.shards > 1);
+        if (listenfds[listen_count] < 0) goto ERR_BIND;
+      }
+    }
      
     freeaddrinfo(servinfo);
-    if (argc > 1) {
-      if (strncmp("-d", argv[1], 2) == 0) {
-        FK_DEBUG("start daemon\n");
-        
-        switch(fork()){
-          case -1: 
-            FK_DEBUG("Failed at forking\n");
-            return -1;
-          case 0:
-            // We should continue the app
-            break;
-          default:
-            _exit(EXIT_SUCCESS);
-        }
+    if (daemonize) {
+      FK_DEBUG("start daemon\n");
+
+      switch(fork()){
+        case -1:
+          FK_DEBUG("Failed at forking\n");
+          return -1;
+        case 0:
+          // We should continue the app
+          break;
+        default:
+          _exit(EXIT_SUCCESS);
       }
     }
     signal(SIGINT, sigHandler);
     signal(SIGTERM, sigHandler);
+    // sendfile() has no MSG_NOSIGNAL, a client hanging up mid-reply has
+    // to be an EPIPE and not the end of the server
+    signal(SIGPIPE, SIG_IGN);
+    // before any other thread, they all inherit SIGUSR1 blocked
+    if (metrics_start(config.metrics_socket) < 0) goto ERR_LISTEN;
+    if (async_log_start(config.log_rate) < 0) goto ERR_LISTEN;
+    if (limit_init() < 0) goto ERR_LISTEN;
     FK_DEBUG("start listening\n");
-    if( listen(sockfd, 5) < 0 ) goto ERR_LISTEN;
-    int f_log = 0;
-
-
-
-    // Create a mutex for file access
-    static pthread_mutex_t m_logfile = PTHREAD_MUTEX_INITIALIZER;
+    for (int i = 0; i < listen_count; i++) {
+      if (listen(listenfds[i], config.backlog) < 0) goto ERR_LISTEN;
+    }
+    listener_log_settings(listenfds[0]);
 
-    // Only use timestamper if we write to a file
-#if !USE_AESD_CHAR_DEVICE
-    f_log = open(LOG_FILE, O_CREAT | O_TRUNC |O_RDWR, 0644);
-    if (f_log < 0) {
-      syslog(LOG_ERR, "OPpenfile failed: %d", f_log);
+    const aesd_log_ops_t *storage = &aesd_log_file_ops;
+    if (config.storage == STORAGE_MMAP) storage = &aesd_log_mmap_ops;
+    else if (config.storage == STORAGE_DEVICE) storage = &aesd_log_device_ops;
+    else if (config.storage == STORAGE_RING) storage = &aesd_log_ring_ops;
+    // the old server is the only writer until it sealed the log
+    off_t resume = handed_over ? handoff_wait() : 0;
+    if (aesd_log_init(storage, resume) < 0) goto ERR_FILE_ERROR;
+    if (config.batch > 1 && aesd_log_group_commit(config.batch, config.batch_delay) < 0) {
       goto ERR_FILE_ERROR;
     }
-    // create timestamper
+
+    // Only use timestamper if we write to a file
     timestamper_data_t t_data;
-    t_data.log_mutex = &m_logfile;
-    t_data.logfile = f_log;
-    pthread_create(&t_data.pid, NULL, &timestamper, (void*) &t_data);
-#endif
+    if (aesd_log_backend()->timestamps && config.timestamp_interval > 0) {
+      pthread_create(&t_data.pid, NULL, &timestamper, NULL);
+    }
 
-    // Linked List for sockets
-    SLIST_INIT(&head);
-    while (1){
-      datap = malloc(sizeof(slist_data_t));
-
-      int len_client_ca = sizeof(struct sockaddr_in);
-      if ( (datap->c = accept(sockfd, (struct sockaddr *) &datap->client_ca, (socklen_t *)&len_client_ca)) < 0) {
-        // failed accepting socket
-        FK_DEBUG("Timed out accepting: %d\n", errno);
-        
-        return 5;
-      }
-      #if USE_AESD_CHAR_DEVICE
-        if (f_log == 0) {
-            f_log = open(AESD_CHAR_DEVICE, O_RDWR, 0644);
-            if (f_log < 0) {
-              syslog(LOG_ERR, "OPpenfile failed: %d", f_log);
-              goto ERR_FILE_ERROR;
-            }
-        }
-      #endif
-      datap->log_mutex = &m_logfile;
-      datap->logfile = f_log;
-      datap->completed = false;
-      // do the fork dance here
-      // update pid in data, and insert to linked lise
-      int rr = pthread_create(&datap->pid, NULL, &connection_thread, (void *) datap);
-      FK_DEBUG("rr: %d\n", rr);
-
-      SLIST_INSERT_HEAD(&head, datap, entries);
-
-      SLIST_FOREACH(datap, &head, entries) {
-        FK_DEBUG("Thread: %ld\n", (long unsigned int)datap->pid);
-
-        if (datap->completed) {
-          FK_DEBUG("Thread: %ld is complete\n", (long unsigned int)datap->pid);
-          void *ret = NULL;
-          pthread_join(datap->pid, &ret);
-          FK_DEBUG("Removing thread: %lu\n", datap->pid);
-          //SLIST_REMOVE(datap, entries);
-          SLIST_REMOVE(&head, datap, slist_data_s, entries);
-          free(datap);
-        }
-        
+    if (config.event_loops == 0) {
+      // shards already spread over the CPUs
+      config.event_loops = (config.shards > 1) ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+      if (config.event_loops < 1) config.event_loops = 1;
+    }
+
+    // every shard serves its own listener, this thread runs the first
+    shard_t *shards = calloc(config.shards, sizeof(shard_t));
+    if (NULL == shards) goto ERR_LISTEN;
+    for (int i = 1; i < config.shards; i++) {
+      shards[i].index = i;
+      if (pthread_create(&shards[i].pid, NULL, &shard_thread, &shards[i]) != 0) {
+        syslog(LOG_ERR, "Error creating shard %d: %d", i, errno);
+        goto ERR_LISTEN;
       }
-    } // while(1)
-      
-    shutdown(sockfd, SHUT_RD);
-    shutdown(sockfd, SHUT_WR);
-    close(sockfd);
+    }
+    if (config.shards > 1) {
+      syslog(LOG_DAEMON, "Serving with %d SO_REUSEPORT shards%s", config.shards,
+             config.pin ? " pinned to CPUs" : "");
+    }
+    if (NULL != config.handoff_socket && handoff_start(config.handoff_socket) < 0) {
+      syslog(LOG_ERR, "Error listening for handoffs: %d", errno);
+      goto ERR_LISTEN;
+    }
+    if (config.pin) shard_pin(0);
+    int rc = shard_run(listenfds[0]);
+    // handed over, the other threads keep serving until the drain is done
+    if (draining) pthread_exit(NULL);
+    if (got_signal) server_stop();
+
+    listeners_close();
     closelog();
-    return 0;
+    return rc;
       
   ERR_GETADDRINFO:
     syslog(LOG_ERR, "getaddrinfo failed");
     goto RETURN_ERR;
-  ERR_SOCKET:
-    freeaddrinfo(servinfo);
-    syslog(LOG_ERR, "Error creating socket");
-    goto RETURN_ERR;
   ERR_BIND:
     freeaddrinfo(servinfo);
+    listeners_close();
     syslog(LOG_ERR, "Error binding to address");
     goto RETURN_ERR;
     
   ERR_LISTEN:
-    close(sockfd);
+    listeners_close();
     syslog(LOG_ERR, "Error listening");
     FK_DEBUG("Cold not listen\n");
     goto RETURN_ERR;
   
   ERR_FILE_ERROR:
-    close(sockfd);
+    listeners_close();
     syslog(LOG_ERR, "Error opening file: %d", errno);
     FK_DEBUG("Error opening file: %d\n", errno);
     goto RETURN_ERR;
@@ -1,14 +1,196 @@
 #ifndef _AESDSOCKET__H_
 #define _AESDSOCKET__H_
 
+// splice(), pipe2(), accept4() and friends
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
-#endif
\ No newline at end of file
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define LOG_FILE "/var/tmp/aesdsocketdata"
+// staging files of long lines, on the same file system as LOG_FILE
+#define SPILL_DIR "/var/tmp"
+#define PORT "9000"
+#define BUFFER_SIZE (1024)
+
+#define DEBUG 0
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+#define AESD_CHAR_DEVICE "/dev/aesdchar"
+
+#define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+// lz4 or off, switches the replies of a connection
+#define COMPRESS_CMD "AESDCHAR_COMPRESS:"
+// turns the connection into a live tail of the log
+#define SUBSCRIBE_CMD "AESDCHAR_SUBSCRIBE"
+
+// How connections are served, selected with -m at startup
+enum server_mode {
+  MODE_THREADS,   // one pthread per accepted connection
+  MODE_POOL,      // fixed worker pool fed by a bounded queue
+  MODE_EPOLL,     // non-blocking sockets driven by epoll loops
+  MODE_URING,     // io_uring rings, falls back to MODE_POOL
+};
+
+// What the pool does with a new connection when its queue is full
+enum overload_policy {
+  OVERLOAD_CLOSE, // close the connection right away
+  OVERLOAD_WAIT,  // stop accepting until a worker frees a slot
+};
+
+// What an epoll connection whose queued replies reach the output limit
+// gets
+enum slow_client_policy {
+  SLOW_CLIENT_PAUSE,  // no more of its lines are answered until it reads
+  SLOW_CLIENT_CLOSE,  // it is disconnected
+};
+
+// What a subscriber that falls config.tail_lag bytes behind gets
+enum tail_policy {
+  TAIL_DROP,    // the oldest appends it wasn't sent yet are skipped
+  TAIL_CLOSE,   // it is disconnected
+};
+
+// Where the log lives, selected with -s at startup
+enum storage_kind {
+  STORAGE_FILE,   // LOG_FILE, timestamped
+  STORAGE_MMAP,   // LOG_FILE written and sent through a shared mapping
+  STORAGE_DEVICE, // AESD_CHAR_DEVICE
+  STORAGE_RING,   // in-process circular buffer, same semantics as the device
+};
+
+typedef struct server_config_s server_config_t;
+struct server_config_s {
+  enum server_mode mode;
+  int event_loops;
+  int workers;
+  int queue_depth;
+  enum overload_policy overload;
+  bool keepalive;   // serve every line on a connection instead of just one
+  enum storage_kind storage;
+  int batch;          // lines per group commit, 1 writes every line itself
+  long batch_delay;   // microseconds the committer waits for a full batch
+  int shards;         // SO_REUSEPORT listeners, each with its own accept loop
+  int backlog;
+  // socket tuning, 0 leaves the kernel default
+  int rcvbuf;
+  int sndbuf;
+  bool nodelay;
+  bool quickack;
+  int defer_accept;   // seconds
+  int fastopen;       // queue length
+  int busy_poll;      // microseconds
+  bool pin;           // pin every shard to a CPU
+  int timestamp_interval;       // seconds, 0 disables the timestamper
+  const char *timestamp_format; // strftime() format, a \n is added
+  const char *metrics_socket;   // UNIX socket serving the metrics, or NULL
+  size_t output_limit;          // bytes of replies queued per connection
+  enum slow_client_policy slow_client;
+  int send_timeout;   // seconds a blocking send may stall, 0 for no limit
+  const char *handoff_socket;   // UNIX socket for hot restarts, or NULL
+  int drain_timeout;  // seconds connections get to finish after a handoff
+  size_t max_line;    // bytes including the \n, 0 for no limit
+  size_t spill;       // partial lines this long go to a staging file, 0 never
+  int log_rate;       // syslog messages per second, 0 for no limit
+  size_t tail_lag;    // bytes queued per subscriber, 0 for no limit
+  enum tail_policy tail_policy;
+  int client_conns;   // per second and client address, 0 for no limit
+  int client_lines;
+  int client_bytes;
+  int global_conns;   // per second for the whole server, 0 for no limit
+  int global_lines;
+  int global_bytes;
+};
+
+extern server_config_t config;
+// Set by the SIGINT/SIGTERM handler, the serving loops stop on it
+extern volatile sig_atomic_t got_signal;
+extern int *listenfds;    // one per shard
+extern int listen_count;
+
+// Compiled out unless DEBUG is set, the arguments are still checked
+#define FK_DEBUG(...) do { if (DEBUG) printf(__VA_ARGS__); } while (0)
+
+// True when a line of len bytes is over the -L limit
+static inline bool line_too_long(size_t len)
+{
+  return config.max_line > 0 && len > config.max_line;
+}
+
+// aesdsocket_commands.c
+bool parse_seekto(const char *line, size_t len, struct aesd_seekto *seekto);
+bool parse_readfrom(const char *line, size_t len, off_t *from);
+bool parse_compress(const char *line, size_t len, bool *compress);
+bool parse_subscribe(const char *line, size_t len);
+
+struct aesd_log_reply_s;
+// compress is the connection's reply setting, commands may change it.
+// event_loop appends past the group commit instead of waiting for it.
+// Returns -1 when the line was refused, the connection should be closed.
+int handle_line(const char *line, size_t len, in_addr_t addr, bool *compress,
+                bool event_loop, struct aesd_log_reply_s *reply);
+// Compresses reply when the connection asked for it
+int finish_reply(bool compress, struct aesd_log_reply_s *reply);
+
+struct sockaddr_in;
+void serve_connection(int c, const struct sockaddr_in *client_ca, uint64_t accepted);
+
+// aesdsocket_tuning.c
+void listener_tune(int fd);
+void conn_tune(int c);
+void listener_log_settings(int fd);
+
+// aesdsocket_handoff.c
+// Set once the listeners are handed over, accept loops stop for good
+extern bool draining;
+// Accept loops register so the handoff can interrupt them with SIGUSR2,
+// and deregister once they saw draining
+void accept_loop_enter(void);
+void accept_loop_leave(void);
+// Takes the listeners over from a server running with the same path,
+// sets listenfds. Returns 1 when it did, 0 when no server answered.
+int handoff_receive(const char *path);
+// Waits until the old server drained and sealed the log, returns where
+// the log continues
+off_t handoff_wait(void);
+// Listens on path for the next server and hands over to it
+int handoff_start(const char *path);
+
+// aesdsocket_tail.c
+// Takes the connection c over as a subscriber, its replies so far must
+// be sent. Returns -1 when it could not, c is still the caller's then.
+int tail_subscribe(int c, const char *client_ip);
+
+// aesdsocket_limit.c
+int limit_init(void);
+// False when a connection from addr is over its rate, close it then
+bool limit_accept(in_addr_t addr);
+// False when a line of len bytes from addr is over the line or byte rate.
+// Only lines appended to the log are charged, commands are free.
+bool limit_line(in_addr_t addr, size_t len);
+
+// aesdsocket_pool.c
+int pool_server_run(int listenfd, int workers, int depth);
+
+// aesdsocket_epoll.c
+int epoll_server_run(int listenfd, int loops);
+
+// aesdsocket_uring.c
+int uring_server_run(int listenfd, int loops);
+
+#endif
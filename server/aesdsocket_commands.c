@@ -0,0 +1,68 @@
+#include "aesdsocket.h"
+
+#include "aesd_log.h"
+
+// Parsers of the command lines, kept out of aesdsocket.c so the tests
+// link them without a server. None of them need the line NUL terminated.
+
+// Parses "AESDCHAR_IOCSEEKTO:X,Y". Arguments that aren't two numbers still
+// make it a seek, to a command that doesn't exist: nothing is appended and
+// the reply is empty, like for any seek the driver refuses.
+bool parse_seekto(const char *line, size_t len, struct aesd_seekto *seekto)
+{
+  char args[32];
+  size_t cmd_len = strlen(SEEKTO_CMD);
+
+  if (len < cmd_len || strncmp(line, SEEKTO_CMD, cmd_len) != 0) return false;
+  len -= cmd_len;
+  if (len < sizeof(args)) {
+    memcpy(args, line + cmd_len, len);
+    args[len] = '\0';
+    if (sscanf(args, "%u,%u", &seekto->write_cmd, &seekto->write_cmd_offset) == 2) return true;
+  }
+  seekto->write_cmd = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+  seekto->write_cmd_offset = 0;
+  return true;
+}
+
+// Parses "AESDCHAR_READFROM:N" where N is the log offset from an earlier
+// resume token, 0 for everything
+bool parse_readfrom(const char *line, size_t len, off_t *from)
+{
+  char args[32];
+  size_t cmd_len = strlen(READFROM_CMD);
+  long long offset;
+
+  if (len <= cmd_len || strncmp(line, READFROM_CMD, cmd_len) != 0) return false;
+  len -= cmd_len;
+  if (len >= sizeof(args)) return false;
+  memcpy(args, line + cmd_len, len);
+  args[len] = '\0';
+  if (sscanf(args, "%lld", &offset) != 1 || offset < 0) return false;
+  *from = offset;
+  return true;
+}
+
+// Parses "AESDCHAR_COMPRESS:lz4" and "AESDCHAR_COMPRESS:off"
+bool parse_compress(const char *line, size_t len, bool *compress)
+{
+  size_t cmd_len = strlen(COMPRESS_CMD);
+
+  if (len <= cmd_len || strncmp(line, COMPRESS_CMD, cmd_len) != 0) return false;
+  line += cmd_len;
+  len -= cmd_len;
+  if (len > 0 && line[len - 1] == '\n') len--;
+  if (len == 3 && strncmp(line, "lz4", 3) == 0) *compress = true;
+  else if (len == 3 && strncmp(line, "off", 3) == 0) *compress = false;
+  else return false;
+  return true;
+}
+
+// Matches "AESDCHAR_SUBSCRIBE"
+bool parse_subscribe(const char *line, size_t len)
+{
+  size_t cmd_len = strlen(SUBSCRIBE_CMD);
+
+  if (len > 0 && line[len - 1] == '\n') len--;
+  return len == cmd_len && strncmp(line, SUBSCRIBE_CMD, cmd_len) == 0;
+}
@@ -0,0 +1,388 @@
+#include "aesdsocket.h"
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "line_parser.h"
+#include "aesd_log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#define MAX_EVENTS 64
+// pipelined lines served per wakeup before other connections get a turn
+#define MAX_LINES_PER_EVENT 16
+
+// Event driven server: every loop owns an epoll instance and the
+// connections it accepted, sockets are non-blocking and each connection
+// is a small state machine instead of a blocked thread.
+//
+// Pipelined lines are answered while earlier replies are still going
+// out, every connection queues its replies and writes them as the socket
+// drains. Once the queue holds config.output_limit bytes the connection
+// is paused (no more lines are taken until it drains) or closed.
+//
+// The log is the one thing handled inline: a line is appended and its
+// reply snapshotted before the loop moves on. Appends go past the group
+// commit and only wait for writes already in flight, snapshots of the
+// log file take no lock. The char device can block on both, with it the
+// server falls back to the worker pool instead.
+
+typedef struct epoll_reply_s epoll_reply_t;
+struct epoll_reply_s {
+  aesd_log_reply_t reply;
+  epoll_reply_t *next;
+};
+
+typedef struct epoll_conn_s epoll_conn_t;
+struct epoll_conn_s {
+  int c;
+  char client_ip[INET_ADDRSTRLEN];
+  in_addr_t addr;     // the client's, for its rate limits
+  bool finished;    // without keepalive, the one line is answered
+  bool compress;    // replies are LZ4 frames
+  bool subscribe;   // goes to the tail thread once its replies are out
+  uint32_t armed;   // events currently registered with epoll
+  uint64_t accepted;  // until the first byte arrives
+
+  line_parser_t parser;
+
+  // replies waiting to be sent, the head one may be partly sent
+  epoll_reply_t *out_head;
+  epoll_reply_t **out_tail;
+  size_t out_pending;   // bytes of all queued replies
+};
+
+static slab_t conn_slab = SLAB_INITIALIZER("epoll connections", sizeof(epoll_conn_t));
+static slab_t reply_slab = SLAB_INITIALIZER("epoll replies", sizeof(epoll_reply_t));
+
+typedef struct epoll_loop_s epoll_loop_t;
+struct epoll_loop_s {
+  pthread_t pid;
+  int epfd;
+  int listenfd;
+  bool stopped;   // listener removed after a handoff
+};
+
+static int set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void conn_close(epoll_loop_t *loop, epoll_conn_t *conn)
+{
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->c, NULL);
+  close(conn->c);
+  metrics_connection(-1);
+  ALOG(LOG_DAEMON | LOG_INFO, "Closed connection from %s", conn->client_ip);
+  line_parser_free(&conn->parser);
+  while (NULL != conn->out_head) {
+    epoll_reply_t *out = conn->out_head;
+    conn->out_head = out->next;
+    aesd_log_reply_free(&out->reply);
+    slab_put(&reply_slab, out);
+  }
+  slab_put(&conn_slab, conn);
+}
+
+// Hands the socket over to the tail thread, the replies are all sent
+static void conn_subscribe(epoll_loop_t *loop, epoll_conn_t *conn)
+{
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->c, NULL);
+  if (tail_subscribe(conn->c, conn->client_ip) < 0) close(conn->c);
+  metrics_connection(-1);
+  line_parser_free(&conn->parser);
+  slab_put(&conn_slab, conn);
+}
+
+static void conn_arm(epoll_loop_t *loop, epoll_conn_t *conn, uint32_t events)
+{
+  if (conn->armed == events) return;
+  struct epoll_event ev = { .events = events, .data.ptr = conn };
+  epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->c, &ev);
+  conn->armed = events;
+}
+
+// True while no more lines should be taken from the client. A reply is
+// always accepted into an empty queue, however large the log is.
+static bool conn_paused(const epoll_conn_t *conn)
+{
+  return conn->finished ||
+         (config.slow_client == SLOW_CLIENT_PAUSE && NULL != conn->out_head &&
+          conn->out_pending >= config.output_limit);
+}
+
+// Handles a complete line: either a command or data for the log, and
+// queues its reply the same way serve_connection would send it.
+static int conn_handle_line(epoll_conn_t *conn, const char *line, size_t len)
+{
+  if (parse_subscribe(line, len)) {
+    // nothing more is read, lines pipelined behind it are dropped
+    metrics_add(COUNTER_LINES, 1);
+    conn->subscribe = true;
+    conn->finished = true;
+    return 0;
+  }
+  epoll_reply_t *out = slab_get(&reply_slab);
+  if (NULL == out) return -1;
+  if (handle_line(line, len, conn->addr, &conn->compress, true, &out->reply) < 0) {
+    slab_put(&reply_slab, out);
+    return -1;
+  }
+  bool queued = (NULL != conn->out_head);
+  out->next = NULL;
+  *conn->out_tail = out;
+  conn->out_tail = &out->next;
+  conn->out_pending += out->reply.size;
+  if (!config.keepalive) conn->finished = true;
+
+  if (queued && conn->out_pending > config.output_limit &&
+      config.slow_client == SLOW_CLIENT_CLOSE) {
+    ALOG(LOG_WARNING, "Closing %s, %zu bytes of replies queued",
+         conn->client_ip, conn->out_pending);
+    return -1;
+  }
+  return 0;
+}
+
+// Sends queued replies as far as the socket accepts them.
+// Returns 1 when the queue is empty, 0 when waiting for EPOLLOUT and -1
+// on errors.
+static int conn_flush(epoll_conn_t *conn)
+{
+  while (NULL != conn->out_head) {
+    epoll_reply_t *out = conn->out_head;
+    aesd_log_reply_t *reply = &out->reply;
+
+    while (!aesd_log_reply_done(reply)) {
+      ssize_t sent = aesd_log_reply_send(conn->c, reply);
+      if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      if (sent == 0) break;
+    }
+    aesd_log_reply_sent(reply);
+    conn->out_pending -= reply->size;
+    conn->out_head = out->next;
+    if (NULL == conn->out_head) conn->out_tail = &conn->out_head;
+    aesd_log_reply_free(reply);
+    slab_put(&reply_slab, out);
+  }
+  return 1;
+}
+
+// Reads until a complete line is buffered and handles it.
+// Returns 1 when a line was handled, 0 when more data is needed or the
+// client is done sending, and -1 when the connection should be closed.
+static int conn_read(epoll_conn_t *conn)
+{
+  const char *line;
+  size_t len;
+
+  while (1) {
+    // lines pipelined behind the previous one are already buffered
+    line = line_parser_next(&conn->parser, &len);
+    if (NULL != line) {
+      if (conn_handle_line(conn, line, len) < 0) return -1;
+      return 1;
+    }
+    // only the unterminated tail is left, the \n is still to come
+    line_parser_pending(&conn->parser, &len);
+    if (line_too_long(len + 1)) {
+      ALOG(LOG_WARNING, "Dropping a line of more than %zu bytes from %s",
+           config.max_line, conn->client_ip);
+      return -1;
+    }
+
+    size_t avail;
+    char *buffer = line_parser_space(&conn->parser, BUFFER_SIZE, &avail);
+    if (NULL == buffer) return -1;
+    ssize_t bytes_read = recv(conn->c, buffer, avail, 0);
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      if (errno == EINTR) continue;
+      FK_DEBUG("socket failure: %d\n", errno);
+      return -1;
+    }
+    if (bytes_read == 0) {
+      // client went away in the middle of a line, keep what we got, and
+      // close once the queued replies are out
+      line = line_parser_pending(&conn->parser, &len);
+      if (len > 0) aesd_log_append_direct(line, len);
+      conn->finished = true;
+      return 0;
+    }
+    if (conn->accepted != 0) {
+      metrics_since(HIST_FIRST_BYTE, conn->accepted);
+      conn->accepted = 0;
+    }
+    metrics_add(COUNTER_BYTES_IN, bytes_read);
+    line_parser_commit(&conn->parser, bytes_read);
+  }
+}
+
+static void conn_event(epoll_loop_t *loop, epoll_conn_t *conn, uint32_t events)
+{
+  bool drained = false;   // nothing more to read right now
+  int rc;
+
+  if (NULL != conn->out_head && (events & (EPOLLERR | EPOLLHUP))) goto CLOSE;
+
+  for (int lines = 0; lines < MAX_LINES_PER_EVENT; lines++) {
+    drained = false;
+    if (!conn_paused(conn)) {
+      rc = conn_read(conn);
+      if (rc < 0) goto CLOSE;
+      drained = (rc == 0);
+    }
+
+    rc = conn_flush(conn);
+    if (rc < 0) goto CLOSE;
+    if (conn->finished && NULL == conn->out_head) {
+      if (!conn->subscribe) goto CLOSE;
+      conn_subscribe(loop, conn);
+      return;
+    }
+    // a full socket only stops us once the queue is full as well
+    if (drained || (rc == 0 && conn_paused(conn))) break;
+  }
+
+  // when the line budget ran out more lines may be buffered, EPOLLOUT
+  // fires right away on a writable socket and brings us back here after
+  // the other connections
+  uint32_t want = 0;
+  if (!conn_paused(conn)) want |= EPOLLIN | EPOLLRDHUP;
+  if (NULL != conn->out_head || !drained) want |= EPOLLOUT;
+  conn_arm(loop, conn, want);
+  return;
+
+CLOSE:
+  conn_close(loop, conn);
+}
+
+static void loop_accept(epoll_loop_t *loop)
+{
+  while (1) {
+    struct sockaddr_in client_ca;
+    socklen_t len_client_ca = sizeof(client_ca);
+    int c = accept4(loop->listenfd, (struct sockaddr *) &client_ca, &len_client_ca,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        FK_DEBUG("accept failed: %d\n", errno);
+      }
+      return;
+    }
+    if (!limit_accept(client_ca.sin_addr.s_addr)) {
+      ALOG(LOG_DAEMON | LOG_INFO, "Refusing a connection, the client is over its rate");
+      close(c);
+      continue;
+    }
+
+    epoll_conn_t *conn = slab_get(&conn_slab);
+    if (NULL == conn) {
+      close(c);
+      continue;
+    }
+    conn_tune(c);
+    memset(conn, 0, sizeof(*conn));
+    conn->c = c;
+    conn->addr = client_ca.sin_addr.s_addr;
+    conn->accepted = metrics_now();
+    conn->out_tail = &conn->out_head;
+    inet_ntop(AF_INET, &client_ca.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+    ALOG(LOG_DAEMON | LOG_INFO, "Accepted connection from %s", conn->client_ip);
+    metrics_connection(1);
+
+    line_parser_init(&conn->parser);
+    conn->armed = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event ev = { .events = conn->armed, .data.ptr = conn };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c, &ev) < 0) {
+      close(c);
+      metrics_connection(-1);
+      line_parser_free(&conn->parser);
+      slab_put(&conn_slab, conn);
+    }
+  }
+}
+
+static void *epoll_loop(void *arg)
+{
+  epoll_loop_t *loop = (epoll_loop_t *) arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  accept_loop_enter();
+  while (!got_signal) {
+    if (draining && !loop->stopped) {
+      // the new server accepts from here on, we only finish our own
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL);
+      loop->stopped = true;
+      accept_loop_leave();
+    }
+    int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "epoll_wait failed: %d", errno);
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (NULL == events[i].data.ptr) {
+        loop_accept(loop);
+      } else {
+        conn_event(loop, events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Runs `loops` epoll loops sharing the listening socket, the calling
+// thread runs the first one. Only returns on errors, or with 1 without
+// touching the listening socket when the log backend blocks, so the
+// caller can fall back to the worker pool.
+int epoll_server_run(int listenfd, int loops)
+{
+  // lines are appended inline, one waiting append stalls every
+  // connection of the loop
+  if (aesd_log_backend()->blocking) {
+    syslog(LOG_WARNING, "Appends to the %s log can block, not serving from epoll loops",
+           aesd_log_backend()->name);
+    return 1;
+  }
+
+  epoll_loop_t *loop_data = calloc(loops, sizeof(epoll_loop_t));
+  if (NULL == loop_data) return -1;
+
+  if (set_nonblocking(listenfd) < 0) goto ERR_SETUP;
+
+  for (int i = 0; i < loops; i++) {
+    loop_data[i].listenfd = listenfd;
+    loop_data[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_data[i].epfd < 0) goto ERR_SETUP;
+
+    // EPOLLEXCLUSIVE wakes only one of the loops per new connection
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (loops > 1) ev.events |= EPOLLEXCLUSIVE;
+    if (epoll_ctl(loop_data[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) goto ERR_SETUP;
+  }
+
+  for (int i = 1; i < loops; i++) {
+    if (pthread_create(&loop_data[i].pid, NULL, &epoll_loop, &loop_data[i]) != 0) {
+      goto ERR_SETUP;
+    }
+  }
+  syslog(LOG_DAEMON, "Serving with %d epoll loop(s)", loops);
+  epoll_loop(&loop_data[0]);
+  return -1;
+
+ERR_SETUP:
+  syslog(LOG_ERR, "Error setting up epoll loops: %d", errno);
+  return -1;
+}
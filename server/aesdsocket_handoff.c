@@ -0,0 +1,286 @@
+#include "aesdsocket.h"
+#include "aesd_log.h"
+#include "metrics.h"
+#include "async_log.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/un.h>
+
+// Hot restart. A server started with -H listens on a UNIX socket; a new
+// server started with the same path connects to it instead of binding
+// and gets the listening sockets with SCM_RIGHTS, so the port never
+// closes. The old server then stops accepting, lets its connections
+// finish and seals the log. The log has a single writer, so the new
+// server only opens it at the end the old one reports; connections
+// arriving meanwhile wait in the shared backlog instead of being
+// refused, for as long as the drain takes: --drain-timeout at most.
+
+// the kernel limit on descriptors per message
+#define HANDOFF_MAX_FDS 253
+#define DRAIN_POLL_NS (100 * 1000 * 1000)
+
+bool draining = false;
+
+// threads that accept on the listeners, the handoff interrupts them
+// until they all stopped
+static pthread_t *accepters = NULL;
+static int accepter_count = 0;
+static int accepter_size = 0;
+static pthread_mutex_t accepters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// connection to the old server while we wait for it to drain
+static int old_server = -1;
+
+void accept_loop_enter(void)
+{
+  pthread_mutex_lock(&accepters_lock);
+  if (accepter_count == accepter_size) {
+    int size = accepter_size ? accepter_size * 2 : 8;
+    pthread_t *grown = realloc(accepters, size * sizeof(pthread_t));
+    if (NULL == grown) {
+      // can't be interrupted, it stops at its next connection instead
+      pthread_mutex_unlock(&accepters_lock);
+      return;
+    }
+    accepters = grown;
+    accepter_size = size;
+  }
+  accepters[accepter_count++] = pthread_self();
+  pthread_mutex_unlock(&accepters_lock);
+}
+
+void accept_loop_leave(void)
+{
+  pthread_mutex_lock(&accepters_lock);
+  for (int i = 0; i < accepter_count; i++) {
+    if (pthread_equal(accepters[i], pthread_self())) {
+      accepters[i] = accepters[--accepter_count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&accepters_lock);
+}
+
+static void handoff_address(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+int handoff_receive(const char *path)
+{
+  struct sockaddr_un addr;
+  int count = 0;
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  handoff_address(path, &addr);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(fd);
+    // nobody there, or a stale socket of a server that is gone
+    if (errno == ENOENT || errno == ECONNREFUSED) return 0;
+    return -1;
+  }
+
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(count) || count < 1 || count > HANDOFF_MAX_FDS || NULL == cmsg ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+    syslog(LOG_ERR, "Bad listener handoff from %s", path);
+    close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+
+  listenfds = calloc(count, sizeof(int));
+  if (NULL == listenfds) {
+    close(fd);
+    return -1;
+  }
+  memcpy(listenfds, CMSG_DATA(cmsg), count * sizeof(int));
+  listen_count = count;
+  old_server = fd;
+  syslog(LOG_DAEMON, "Took over %d listener(s) from %s", count, path);
+  return 1;
+}
+
+off_t handoff_wait(void)
+{
+  int64_t end;
+  size_t got = 0;
+
+  syslog(LOG_DAEMON, "Waiting for the old server to drain");
+  while (got < sizeof(end)) {
+    ssize_t n = recv(old_server, (char *) &end + got, sizeof(end) - got, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  close(old_server);
+  old_server = -1;
+
+  // an epoll server left them non-blocking, that is shared with us
+  for (int i = 0; i < listen_count; i++) {
+    int flags = fcntl(listenfds[i], F_GETFL);
+    if (flags >= 0) fcntl(listenfds[i], F_SETFL, flags & ~O_NONBLOCK);
+  }
+
+  if (got < sizeof(end)) {
+    syslog(LOG_WARNING, "Old server went away without handing over the log, starting a new one");
+    return 0;
+  }
+  return end < 0 ? 0 : end;
+}
+
+static void wake(int sig)
+{
+  // only there to interrupt accept() and friends
+}
+
+// Interrupts the accept loops until every one of them saw draining
+static void stop_accepting(void)
+{
+  struct timespec retry = { .tv_nsec = 10 * 1000 * 1000 };
+
+  __atomic_store_n(&draining, true, __ATOMIC_RELEASE);
+  while (1) {
+    pthread_mutex_lock(&accepters_lock);
+    int left = accepter_count;
+    for (int i = 0; i < accepter_count; i++) pthread_kill(accepters[i], SIGUSR2);
+    pthread_mutex_unlock(&accepters_lock);
+    if (left == 0) break;
+    // a signal landing just before a loop blocks again is lost, resend
+    nanosleep(&retry, NULL);
+  }
+}
+
+// Waits for open connections to finish, returns how many are left
+static long drain(int timeout)
+{
+  struct timespec interval = { .tv_nsec = DRAIN_POLL_NS };
+  uint64_t deadline = metrics_now() + (uint64_t) timeout * 1000000000ULL;
+  long open;
+
+  while ((open = metrics_connections()) > 0 && metrics_now() < deadline) {
+    nanosleep(&interval, NULL);
+  }
+  return open;
+}
+
+static int send_listeners(int c)
+{
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  struct iovec iov = { .iov_base = &listen_count, .iov_len = sizeof(listen_count) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = CMSG_SPACE(listen_count * sizeof(int)),
+  };
+
+  memset(control, 0, sizeof(control));
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(listen_count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), listenfds, listen_count * sizeof(int));
+
+  ssize_t n;
+  do {
+    n = sendmsg(c, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  return n == sizeof(listen_count) ? 0 : -1;
+}
+
+static void *handoff_thread(void *arg)
+{
+  int listenfd = (int) (intptr_t) arg;
+  int c;
+
+  while (1) {
+    c = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (c < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      syslog(LOG_ERR, "Handoff accept failed: %d", errno);
+      return NULL;
+    }
+    if (send_listeners(c) == 0) break;
+    // the new server died on us, keep serving
+    syslog(LOG_ERR, "Handing over the listeners failed: %d", errno);
+    close(c);
+  }
+
+  syslog(LOG_DAEMON, "Handed over the listeners, draining %ld connection(s)",
+         metrics_connections());
+  stop_accepting();
+  long left = drain(config.drain_timeout);
+  if (left > 0) {
+    syslog(LOG_WARNING, "Drain timed out, dropping %ld connection(s)", left);
+  }
+
+  // the listeners, the log file and the sockets at our paths are the new
+  // server's now, nothing gets closed or unlinked on the way out
+  int64_t end = aesd_log_seal();
+  size_t sent = 0;
+  while (sent < sizeof(end)) {
+    ssize_t n = send(c, (char *) &end + sent, sizeof(end) - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      syslog(LOG_ERR, "Handing over the log failed: %d", errno);
+      break;
+    }
+    sent += n;
+  }
+  syslog(LOG_DAEMON, "Handoff complete, exiting");
+  async_log_flush();
+  closelog();
+  _exit(EXIT_SUCCESS);
+}
+
+int handoff_start(const char *path)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  pthread_t pid;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  // no SA_RESTART, blocked accept loops have to return EINTR
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = wake;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR2, &sa, NULL) < 0) return -1;
+
+  handoff_address(path, &addr);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (pthread_create(&pid, NULL, &handoff_thread, (void *) (intptr_t) fd) != 0) {
+    close(fd);
+    return -1;
+  }
+  pthread_detach(pid);
+  return 0;
+}
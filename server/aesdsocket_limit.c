@@ -0,0 +1,203 @@
+#include "aesdsocket.h"
+#include <stdlib.h>
+
+#include "metrics.h"
+
+// Admission control. Every client address has token buckets for
+// connections, lines and bytes per second, and so does the server as a
+// whole; a connection is checked at accept and a line before it is
+// appended to the log, commands are free. A bucket holds one second
+// worth of its rate, a refusal takes nothing from any of them.
+//
+// The buckets are kept as GCRA: instead of a token count each one stores
+// the time it will be full again, so taking from it is one comparison
+// and one add. The global ones are a single word updated with CAS, the
+// client ones live in a fixed set-associative table with a lock per set.
+// A full set evicts an idle client, or the one seen longest ago, so the
+// table never grows; an evicted client starts over with full buckets.
+
+#define LIMIT_SETS 1024       // power of 2
+#define LIMIT_WAYS 8
+#define BURST_NS 1000000000ULL
+// costs saturate here, centuries of bucket time, so full_at + cost can't
+// overflow either
+#define COST_MAX (UINT64_MAX / 4)
+
+enum limit_kind {
+  LIMIT_CONNS,
+  LIMIT_LINES,
+  LIMIT_BYTES,
+  LIMIT_KINDS,
+};
+
+typedef struct limit_client_s limit_client_t;
+struct limit_client_s {
+  in_addr_t addr;
+  bool used;
+  uint64_t seen;
+  uint64_t full_at[LIMIT_KINDS];
+};
+
+typedef struct limit_set_s limit_set_t;
+struct limit_set_s {
+  pthread_mutex_t lock;
+  limit_client_t ways[LIMIT_WAYS];
+};
+
+static limit_set_t *sets = NULL;
+static uint64_t global_full_at[LIMIT_KINDS];
+static bool limiting = false;
+
+// ns of bucket time n units cost at rate per second. Whole seconds and
+// the rest are converted apart, n * BURST_NS overflows for long lines.
+static uint64_t limit_cost(int rate, uint64_t n)
+{
+  uint64_t seconds = n / rate;
+  if (seconds >= COST_MAX / BURST_NS) return COST_MAX;
+  return seconds * BURST_NS + (n % rate) * BURST_NS / rate;
+}
+
+// True when a bucket full again at full_at has room for cost. A full
+// bucket always has, so a line longer than a second worth of bytes still
+// gets through once the client waited for it.
+static bool bucket_admits(uint64_t full_at, uint64_t now, uint64_t cost)
+{
+  return full_at <= now || full_at + cost - now <= BURST_NS;
+}
+
+static uint64_t bucket_take(uint64_t full_at, uint64_t now, uint64_t cost)
+{
+  return (full_at > now ? full_at : now) + cost;
+}
+
+// Global buckets are taken before the client's and given back when the
+// client refuses, nothing is spent on a refused connection or line
+static bool global_take(enum limit_kind kind, int rate, uint64_t n, uint64_t now)
+{
+  if (rate <= 0) return true;
+  uint64_t cost = limit_cost(rate, n);
+  uint64_t full_at = __atomic_load_n(&global_full_at[kind], __ATOMIC_RELAXED);
+  do {
+    if (!bucket_admits(full_at, now, cost)) return false;
+  } while (!__atomic_compare_exchange_n(&global_full_at[kind], &full_at,
+                                        bucket_take(full_at, now, cost), true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+
+static void global_refund(enum limit_kind kind, int rate, uint64_t n)
+{
+  if (rate <= 0) return;
+  __atomic_sub_fetch(&global_full_at[kind], limit_cost(rate, n), __ATOMIC_RELAXED);
+}
+
+// True when all buckets of the client are full, forgetting it changes
+// nothing
+static bool client_idle(const limit_client_t *client, uint64_t now)
+{
+  for (int k = 0; k < LIMIT_KINDS; k++) {
+    if (client->full_at[k] > now) return false;
+  }
+  return true;
+}
+
+// Finds or makes room for addr in its set, lock held
+static limit_client_t *client_find(limit_set_t *set, in_addr_t addr, uint64_t now)
+{
+  limit_client_t *unused = NULL;
+  limit_client_t *idle = NULL;
+  limit_client_t *oldest = NULL;
+
+  for (int i = 0; i < LIMIT_WAYS; i++) {
+    limit_client_t *client = &set->ways[i];
+    if (!client->used) {
+      if (NULL == unused) unused = client;
+      continue;
+    }
+    if (client->addr == addr) return client;
+    if (NULL == idle && client_idle(client, now)) idle = client;
+    if (NULL == oldest || client->seen < oldest->seen) oldest = client;
+  }
+  limit_client_t *victim = (NULL != unused) ? unused : (NULL != idle) ? idle : oldest;
+  memset(victim, 0, sizeof(*victim));
+  victim->used = true;
+  victim->addr = addr;
+  return victim;
+}
+
+// Takes n from one client bucket and, for lines, bytes from another,
+// all or nothing
+static bool client_take(in_addr_t addr, enum limit_kind kind, int rate, uint64_t n,
+                        int byte_rate, uint64_t bytes, uint64_t now)
+{
+  if (rate <= 0 && byte_rate <= 0) return true;
+  uint32_t hash = (uint32_t) addr * 2654435761U;
+  limit_set_t *set = &sets[(hash >> 16) & (LIMIT_SETS - 1)];
+  uint64_t cost = (rate > 0) ? limit_cost(rate, n) : 0;
+  uint64_t byte_cost = (byte_rate > 0) ? limit_cost(byte_rate, bytes) : 0;
+  bool admitted = false;
+
+  pthread_mutex_lock(&set->lock);
+  limit_client_t *client = client_find(set, addr, now);
+  client->seen = now;
+  if ((rate <= 0 || bucket_admits(client->full_at[kind], now, cost)) &&
+      (byte_rate <= 0 || bucket_admits(client->full_at[LIMIT_BYTES], now, byte_cost))) {
+    if (rate > 0) client->full_at[kind] = bucket_take(client->full_at[kind], now, cost);
+    if (byte_rate > 0) {
+      client->full_at[LIMIT_BYTES] = bucket_take(client->full_at[LIMIT_BYTES], now, byte_cost);
+    }
+    admitted = true;
+  }
+  pthread_mutex_unlock(&set->lock);
+  return admitted;
+}
+
+int limit_init(void)
+{
+  limiting = config.client_conns > 0 || config.client_lines > 0 || config.client_bytes > 0 ||
+             config.global_conns > 0 || config.global_lines > 0 || config.global_bytes > 0;
+  if (NULL != sets ||
+      (config.client_conns <= 0 && config.client_lines <= 0 && config.client_bytes <= 0)) {
+    return 0;
+  }
+
+  sets = calloc(LIMIT_SETS, sizeof(limit_set_t));
+  if (NULL == sets) return -1;
+  for (int i = 0; i < LIMIT_SETS; i++) pthread_mutex_init(&sets[i].lock, NULL);
+  return 0;
+}
+
+bool limit_accept(in_addr_t addr)
+{
+  if (!limiting) return true;
+
+  uint64_t now = metrics_now();
+  if (!global_take(LIMIT_CONNS, config.global_conns, 1, now)) goto REFUSED;
+  if (!client_take(addr, LIMIT_CONNS, config.client_conns, 1, 0, 0, now)) {
+    global_refund(LIMIT_CONNS, config.global_conns, 1);
+    goto REFUSED;
+  }
+  return true;
+
+REFUSED:
+  metrics_add(COUNTER_LIMITED_CONNS, 1);
+  return false;
+}
+
+bool limit_line(in_addr_t addr, size_t len)
+{
+  if (!limiting) return true;
+
+  uint64_t now = metrics_now();
+  if (!global_take(LIMIT_LINES, config.global_lines, 1, now)) goto REFUSED;
+  if (!global_take(LIMIT_BYTES, config.global_bytes, len, now)) goto REFUND_LINES;
+  if (client_take(addr, LIMIT_LINES, config.client_lines, 1, config.client_bytes, len, now)) {
+    return true;
+  }
+  global_refund(LIMIT_BYTES, config.global_bytes, len);
+REFUND_LINES:
+  global_refund(LIMIT_LINES, config.global_lines, 1);
+REFUSED:
+  metrics_add(COUNTER_LIMITED_LINES, 1);
+  return false;
+}
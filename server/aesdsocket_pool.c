@@ -0,0 +1,135 @@
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "async_log.h"
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Fixed size worker pool: the accepting thread pushes sockets into a
+// bounded queue and pre-spawned workers serve them with
+// serve_connection(). No allocation or thread creation per connection.
+// Every shard runs a pool of its own.
+
+typedef struct pool_job_s pool_job_t;
+struct pool_job_s {
+  int c;
+  struct sockaddr_in client_ca;
+  uint64_t accepted;
+};
+
+typedef struct pool_queue_s pool_queue_t;
+struct pool_queue_s {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pool_job_t *jobs;
+  int depth;
+  int head;
+  int count;
+  unsigned long rejected;
+};
+
+static void *pool_worker(void *arg)
+{
+  pool_queue_t *queue = (pool_queue_t *) arg;
+  pool_job_t job;
+
+  while (1) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+      pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    serve_connection(job.c, &job.client_ca, job.accepted);
+  }
+  return NULL;
+}
+
+// Queues a job, returns false when the queue is full and the overload
+// policy says not to wait for a free slot
+static bool pool_push(pool_queue_t *queue, const pool_job_t *job)
+{
+  pthread_mutex_lock(&queue->lock);
+  if (config.overload == OVERLOAD_CLOSE) {
+    if (queue->count == queue->depth) {
+      queue->rejected++;
+      pthread_mutex_unlock(&queue->lock);
+      return false;
+    }
+  } else {
+    while (queue->count == queue->depth) {
+      pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+  }
+  queue->jobs[(queue->head + queue->count) % queue->depth] = *job;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return true;
+}
+
+// Starts `workers` threads and accepts connections on the calling thread.
+// Only returns on errors, or with 0 after a handoff while the workers
+// finish the queue.
+int pool_server_run(int listenfd, int workers, int depth)
+{
+  pool_queue_t *queue = calloc(1, sizeof(pool_queue_t));
+  if (NULL == queue) return -1;
+  queue->jobs = calloc(depth, sizeof(pool_job_t));
+  if (NULL == queue->jobs) {
+    free(queue);
+    return -1;
+  }
+  queue->depth = depth;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+
+  for (int i = 0; i < workers; i++) {
+    pthread_t pid;
+    if (pthread_create(&pid, NULL, &pool_worker, queue) != 0) {
+      syslog(LOG_ERR, "Error creating worker %d: %d", i, errno);
+      return -1;
+    }
+    pthread_detach(pid);
+  }
+  syslog(LOG_DAEMON, "Serving with %d workers, queue depth %d", workers, depth);
+
+  accept_loop_enter();
+  while (1) {
+    pool_job_t job;
+    socklen_t len_client_ca = sizeof(job.client_ca);
+
+    job.c = accept4(listenfd, (struct sockaddr *) &job.client_ca, &len_client_ca, SOCK_CLOEXEC);
+    if (job.c < 0) {
+      if (draining) {
+        accept_loop_leave();
+        return 0;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      FK_DEBUG("Failed accepting: %d\n", errno);
+      return -1;
+    }
+    if (!limit_accept(job.client_ca.sin_addr.s_addr)) {
+      ALOG(LOG_DAEMON | LOG_INFO, "Refusing a connection, the client is over its rate");
+      close(job.c);
+      continue;
+    }
+    job.accepted = metrics_now();
+    conn_tune(job.c);
+    // counted while queued too, a handoff waits for the queue
+    metrics_connection(1);
+
+    if (!pool_push(queue, &job)) {
+      // overloaded, refuse instead of queueing unbounded work
+      ALOG(LOG_WARNING, "Queue full, rejected connection (%lu total)", queue->rejected);
+      close(job.c);
+      metrics_connection(-1);
+    }
+  }
+}
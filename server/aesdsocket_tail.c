@@ -0,0 +1,364 @@
+#include "aesdsocket.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "aesd_log.h"
+#include "metrics.h"
+#include "async_log.h"
+
+// Live tail. A connection that sends AESDCHAR_SUBSCRIBE is handed to the
+// tail thread, which owns every subscriber and pushes what gets appended
+// to the log from then on. Each append is read from the log once into a
+// chunk shared by all subscribers; a chunk is refcounted by the
+// subscribers that still have to send it and goes away with the last
+// one. Sockets are non-blocking and sent with one sendmsg() over as many
+// chunks as are queued, a subscriber that stops reading only ever costs
+// its own queue, capped at config.tail_lag bytes. The stream is always
+// plain text, AESDCHAR_COMPRESS only applies to replies.
+
+#define MAX_EVENTS 64
+#define TAIL_IOV 64
+
+typedef struct tail_chunk_s tail_chunk_t;
+struct tail_chunk_s {
+  int refs;             // subscribers that still send it
+  size_t len;
+  tail_chunk_t *next;   // published after this one
+  char data[];
+};
+
+typedef struct tail_sub_s tail_sub_t;
+struct tail_sub_s {
+  int c;
+  char client_ip[INET_ADDRSTRLEN];
+  uint32_t armed;
+  // the resume token, where in the log the stream starts
+  char head[64];
+  size_t head_len;
+  size_t head_sent;
+  // partly sent chunk, or NULL
+  tail_chunk_t *cur;
+  size_t cur_sent;
+  // first chunk after cur, NULL when caught up
+  tail_chunk_t *next;
+  size_t queued;        // unsent bytes of cur and every chunk from next
+  tail_sub_t *link;     // on joining, then on subs
+};
+
+// chunks in publishing order, only the tail thread touches them
+static tail_chunk_t *chunks_head = NULL;
+static tail_chunk_t **chunks_tail = &chunks_head;
+static tail_sub_t *subs = NULL;
+static off_t tail_end = 0;    // the log is published up to here
+
+// handed over by the serving threads
+static tail_sub_t *joining = NULL;
+static pthread_mutex_t joining_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int epfd = -1;
+static int wake_fd = -1;
+static bool wake_pending = false;
+static long subscribers = 0;    // joining or on subs
+static pthread_once_t tail_once = PTHREAD_ONCE_INIT;
+static bool tail_started = false;
+
+// Called by aesd_log after appends, a single wakeup covers all appends
+// until the tail thread looks at the log again
+static void tail_notify(void)
+{
+  uint64_t one = 1;
+
+  if (__atomic_load_n(&subscribers, __ATOMIC_ACQUIRE) == 0) return;
+  if (__atomic_exchange_n(&wake_pending, true, __ATOMIC_SEQ_CST)) return;
+  if (write(wake_fd, &one, sizeof(one)) < 0) FK_DEBUG("Waking tail failed: %d\n", errno);
+}
+
+// Frees chunks from the front once every subscriber is past them
+static void chunks_reclaim(void)
+{
+  while (NULL != chunks_head && chunks_head->refs == 0) {
+    tail_chunk_t *chunk = chunks_head;
+    chunks_head = chunk->next;
+    free(chunk);
+  }
+  if (NULL == chunks_head) chunks_tail = &chunks_head;
+}
+
+static void sub_close(tail_sub_t *sub)
+{
+  if (NULL != sub->cur) sub->cur->refs--;
+  for (tail_chunk_t *chunk = sub->next; NULL != chunk; chunk = chunk->next) chunk->refs--;
+  chunks_reclaim();
+
+  for (tail_sub_t **at = &subs; NULL != *at; at = &(*at)->link) {
+    if (*at == sub) {
+      *at = sub->link;
+      break;
+    }
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, sub->c, NULL);
+  close(sub->c);
+  __atomic_sub_fetch(&subscribers, 1, __ATOMIC_RELEASE);
+  ALOG(LOG_DAEMON | LOG_INFO, "Closed subscription of %s", sub->client_ip);
+  free(sub);
+}
+
+static void sub_arm(tail_sub_t *sub, uint32_t events)
+{
+  if (sub->armed == events) return;
+  struct epoll_event ev = { .events = events, .data.ptr = sub };
+  epoll_ctl(epfd, EPOLL_CTL_MOD, sub->c, &ev);
+  sub->armed = events;
+}
+
+// Sends the head and queued chunks as far as the socket takes them.
+// Returns -1 when the subscriber is gone.
+static int sub_flush(tail_sub_t *sub)
+{
+  struct iovec iov[TAIL_IOV];
+
+  while (sub->head_sent < sub->head_len || sub->queued > 0) {
+    int count = 0;
+    if (sub->head_sent < sub->head_len) {
+      iov[count].iov_base = sub->head + sub->head_sent;
+      iov[count++].iov_len = sub->head_len - sub->head_sent;
+    }
+    if (NULL != sub->cur) {
+      iov[count].iov_base = sub->cur->data + sub->cur_sent;
+      iov[count++].iov_len = sub->cur->len - sub->cur_sent;
+    }
+    for (tail_chunk_t *chunk = sub->next; NULL != chunk && count < TAIL_IOV; chunk = chunk->next) {
+      iov[count].iov_base = chunk->data;
+      iov[count++].iov_len = chunk->len;
+    }
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    ssize_t sent = sendmsg(sub->c, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    if (sent == 0) break;
+
+    size_t left = sent;
+    size_t head = sub->head_len - sub->head_sent;
+    if (head > left) head = left;
+    sub->head_sent += head;
+    left -= head;
+    metrics_add(COUNTER_TAIL_OUT, left);
+    sub->queued -= left;
+    if (NULL != sub->cur) {
+      size_t n = sub->cur->len - sub->cur_sent;
+      if (n > left) n = left;
+      sub->cur_sent += n;
+      left -= n;
+      if (sub->cur_sent < sub->cur->len) continue;
+      sub->cur->refs--;
+      sub->cur = NULL;
+    }
+    while (left > 0) {
+      tail_chunk_t *chunk = sub->next;
+      sub->next = chunk->next;
+      if (left < chunk->len) {
+        sub->cur = chunk;
+        sub->cur_sent = left;
+        break;
+      }
+      left -= chunk->len;
+      chunk->refs--;
+    }
+  }
+  chunks_reclaim();
+
+  uint32_t want = EPOLLIN | EPOLLRDHUP;
+  if (sub->head_sent < sub->head_len || sub->queued > 0) want |= EPOLLOUT;
+  sub_arm(sub, want);
+  return 0;
+}
+
+// Applies the lag cap after a chunk was queued. Dropping skips the oldest
+// whole chunks, a partly sent one is finished so the stream only loses
+// complete appends. The newest chunk is always kept.
+// Returns -1 when the subscriber has to go.
+static int sub_limit(tail_sub_t *sub)
+{
+  if (config.tail_lag == 0 || sub->queued <= config.tail_lag) return 0;
+  if (config.tail_policy == TAIL_CLOSE) {
+    ALOG(LOG_WARNING, "Closing subscription of %s, %zu bytes behind",
+         sub->client_ip, sub->queued);
+    return -1;
+  }
+
+  size_t dropped = 0;
+  while (sub->queued > config.tail_lag && NULL != sub->next && NULL != sub->next->next) {
+    tail_chunk_t *chunk = sub->next;
+    sub->next = chunk->next;
+    sub->queued -= chunk->len;
+    dropped += chunk->len;
+    chunk->refs--;
+  }
+  if (dropped > 0) {
+    metrics_add(COUNTER_TAIL_DROPPED, dropped);
+    ALOG(LOG_WARNING, "Subscriber %s is lagging, dropped %zu bytes", sub->client_ip, dropped);
+  }
+  return 0;
+}
+
+// Reads what was appended since tail_end into one chunk and queues it to
+// every subscriber. A chunk holds whole appends, so dropping it never
+// cuts a line.
+static void publish(void)
+{
+  aesd_log_reply_t reply;
+  tail_chunk_t *chunk = NULL;
+  int refs = 0;
+
+  if (aesd_log_snapshot_from(&reply, tail_end) < 0) return;
+  for (tail_sub_t *sub = subs; NULL != sub; sub = sub->link) refs++;
+  // with nobody to send it to we only catch up
+  size_t len = reply.end - reply.pos;
+  if (refs > 0 && len > 0) {
+    chunk = malloc(sizeof(tail_chunk_t) + len);
+    if (NULL != chunk && aesd_log_reply_read(&reply, reply.pos, len, chunk->data) < 0) {
+      free(chunk);
+      chunk = NULL;
+    }
+  }
+  // what can't be read is skipped like data older than the log keeps
+  tail_end = reply.base + reply.end;
+  aesd_log_reply_free(&reply);
+  if (NULL == chunk) return;
+
+  chunk->refs = refs;
+  chunk->len = len;
+  chunk->next = NULL;
+  *chunks_tail = chunk;
+  chunks_tail = &chunk->next;
+
+  tail_sub_t *sub = subs;
+  while (NULL != sub) {
+    tail_sub_t *link = sub->link;
+    sub->queued += len;
+    if (NULL == sub->next) sub->next = chunk;
+    if (sub_limit(sub) < 0 || sub_flush(sub) < 0) sub_close(sub);
+    sub = link;
+  }
+}
+
+static void sub_start(tail_sub_t *sub)
+{
+  int flags = fcntl(sub->c, F_GETFL, 0);
+  if (flags >= 0) fcntl(sub->c, F_SETFL, flags | O_NONBLOCK);
+  sub->head_len = snprintf(sub->head, sizeof(sub->head), RESUME_HEAD "%lld,0\n",
+                           (long long) tail_end);
+  sub->armed = EPOLLIN | EPOLLRDHUP;
+  sub->link = subs;
+  subs = sub;
+  struct epoll_event ev = { .events = sub->armed, .data.ptr = sub };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sub->c, &ev) < 0 || sub_flush(sub) < 0) sub_close(sub);
+}
+
+// Subscribers send nothing, whatever they do is read and thrown away
+// until they close
+static void sub_event(tail_sub_t *sub, uint32_t events)
+{
+  char discard[BUFFER_SIZE];
+
+  if (events & (EPOLLERR | EPOLLHUP)) goto CLOSE;
+  if (events & (EPOLLIN | EPOLLRDHUP)) {
+    while (1) {
+      ssize_t n = recv(sub->c, discard, sizeof(discard), MSG_DONTWAIT);
+      if (n > 0) continue;
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      goto CLOSE;
+    }
+  }
+  if ((events & EPOLLOUT) && sub_flush(sub) < 0) goto CLOSE;
+  return;
+
+CLOSE:
+  sub_close(sub);
+}
+
+static void *tail_thread(void *arg)
+{
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t count;
+
+  while (1) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Tail epoll_wait failed: %d", errno);
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      if (NULL != events[i].data.ptr) {
+        sub_event(events[i].data.ptr, events[i].events);
+        continue;
+      }
+      if (read(wake_fd, &count, sizeof(count)) < 0) FK_DEBUG("Tail wakeup: %d\n", errno);
+      // appends from here on wake us again
+      __atomic_store_n(&wake_pending, false, __ATOMIC_SEQ_CST);
+      pthread_mutex_lock(&joining_lock);
+      tail_sub_t *sub = joining;
+      joining = NULL;
+      pthread_mutex_unlock(&joining_lock);
+
+      // new subscribers start behind everything appended so far
+      publish();
+      while (NULL != sub) {
+        tail_sub_t *link = sub->link;
+        sub_start(sub);
+        sub = link;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void tail_start(void)
+{
+  pthread_t pid;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (epfd < 0 || wake_fd < 0) goto ERR_START;
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) goto ERR_START;
+  if (pthread_create(&pid, NULL, &tail_thread, NULL) != 0) goto ERR_START;
+  pthread_detach(pid);
+  aesd_log_watch(&tail_notify);
+  tail_started = true;
+  return;
+
+ERR_START:
+  syslog(LOG_ERR, "Error starting the tail thread: %d", errno);
+}
+
+int tail_subscribe(int c, const char *client_ip)
+{
+  uint64_t one = 1;
+
+  pthread_once(&tail_once, &tail_start);
+  if (!tail_started) return -1;
+  tail_sub_t *sub = calloc(1, sizeof(tail_sub_t));
+  if (NULL == sub) return -1;
+  sub->c = c;
+  strncpy(sub->client_ip, client_ip, sizeof(sub->client_ip) - 1);
+  ALOG(LOG_DAEMON | LOG_INFO, "Subscription from %s", client_ip);
+
+  __atomic_add_fetch(&subscribers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&joining_lock);
+  sub->link = joining;
+  joining = sub;
+  pthread_mutex_unlock(&joining_lock);
+  if (write(wake_fd, &one, sizeof(one)) < 0) FK_DEBUG("Waking tail failed: %d\n", errno);
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include "aesdsocket.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+// Socket options from the command line. Listener options are set before
+// bind() so accepted sockets inherit them (buffer sizes have to be known
+// before the handshake to pick the window scale), per connection options
+// are set right after accept. Failures are logged and otherwise ignored,
+// the server works with the kernel defaults.
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+static void tune(int fd, int level, int name, int value, const char *what)
+{
+  if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+    syslog(LOG_WARNING, "Setting %s to %d failed: %d", what, value, errno);
+  }
+}
+
+void listener_tune(int fd)
+{
+  if (config.rcvbuf > 0) tune(fd, SOL_SOCKET, SO_RCVBUF, config.rcvbuf, "SO_RCVBUF");
+  if (config.sndbuf > 0) tune(fd, SOL_SOCKET, SO_SNDBUF, config.sndbuf, "SO_SNDBUF");
+  if (config.busy_poll > 0) tune(fd, SOL_SOCKET, SO_BUSY_POLL, config.busy_poll, "SO_BUSY_POLL");
+  if (config.defer_accept > 0) {
+    tune(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.defer_accept, "TCP_DEFER_ACCEPT");
+  }
+  if (config.fastopen > 0) tune(fd, IPPROTO_TCP, TCP_FASTOPEN, config.fastopen, "TCP_FASTOPEN");
+}
+
+void conn_tune(int c)
+{
+  int on = 1;
+
+  // not worth a log line per connection
+  if (config.nodelay) setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  // the kernel drops back to delayed ACKs on its own, this covers the
+  // first request
+  if (config.quickack) setsockopt(c, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+static int get_int(int fd, int level, int name)
+{
+  int value = -1;
+  socklen_t len = sizeof(value);
+  if (getsockopt(fd, level, name, &value, &len) < 0) return -1;
+  return value;
+}
+
+// net.core.somaxconn silently caps the backlog
+static int somaxconn(void)
+{
+  int value = -1;
+  FILE *f = fopen("/proc/sys/net/core/somaxconn", "re");
+  if (NULL == f) return -1;
+  if (fscanf(f, "%d", &value) != 1) value = -1;
+  fclose(f);
+  return value;
+}
+
+void listener_log_settings(int fd)
+{
+  int max_backlog = somaxconn();
+  int backlog = (max_backlog > 0 && config.backlog > max_backlog) ? max_backlog : config.backlog;
+
+  syslog(LOG_DAEMON, "Socket settings: backlog %d (asked %d), rcvbuf %d, sndbuf %d, "
+         "defer_accept %ds, fastopen %d, busy_poll %dus, nodelay %s, quickack %s",
+         backlog, config.backlog,
+         get_int(fd, SOL_SOCKET, SO_RCVBUF), get_int(fd, SOL_SOCKET, SO_SNDBUF),
+         get_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT), get_int(fd, IPPROTO_TCP, TCP_FASTOPEN),
+         get_int(fd, SOL_SOCKET, SO_BUSY_POLL),
+         config.nodelay ? "on" : "off", config.quickack ? "on" : "off");
+}
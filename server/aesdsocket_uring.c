@@ -0,0 +1,856 @@
+#include "aesdsocket.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "line_parser.h"
+#include "aesd_log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "async_log.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// io_uring engine: one ring per loop thread, a multishot accept on the
+// shared listening socket and every recv/write/read/send of a connection
+// submitted through the ring. Each connection has exactly one request in
+// flight, so the state machine moves forward on every completion.
+// Talks to the kernel with raw syscalls, no liburing needed.
+
+// multishot accept and provided buffer rings both arrived in 5.19
+#ifdef IORING_ACCEPT_MULTISHOT
+
+#define RING_ENTRIES 1024
+#define RECV_BUFFERS 256              // must be a power of 2
+#define RECV_BUFFER_SIZE BUFFER_SIZE
+#define REPLY_BUFFER_SIZE (64 * 1024)
+#define BUFFER_GROUP 0
+// how often connections waiting for an earlier append, or for a receive
+// buffer, are checked
+#define PARKED_POLL_NS (50 * 1000)
+
+// stored in the low bits of user_data, connections come from a slab of
+// malloc()ed objects, aligned to 16 bytes
+enum uring_op {
+  OP_ACCEPT = 1,
+  OP_RECV,
+  OP_WRITE,
+  OP_READ,
+  OP_SEND,
+  OP_SENDMSG,
+  OP_CLOSE,
+  OP_TIMEOUT,
+  OP_CANCEL,
+};
+#define OP_MASK 0xfULL
+
+typedef struct uring_conn_s uring_conn_t;
+struct uring_conn_s {
+  int c;
+  char client_ip[INET_ADDRSTRLEN];
+  in_addr_t addr;     // the client's, for its rate limits
+  bool closing;   // client left before \n, close once the write is done
+  bool compress;  // replies are LZ4 frames
+  uint64_t accepted;    // until the first byte arrives
+  uint64_t line_start;  // of the line being appended
+
+  line_parser_t parser;
+
+  // log range reserved by the write in flight, the data stays in the
+  // parser buffer until it completes
+  const char *write_data;
+  off_t write_off;
+  size_t write_len;
+  size_t write_done;
+  // waiting for appends before write_off to commit
+  uring_conn_t *next_parked;
+  // waiting for a receive buffer to come back to the ring
+  uring_conn_t *next_starved;
+
+  aesd_log_reply_t reply;
+  struct iovec iov[AESD_LOG_MAX_IOV];   // unsent part of an iov reply
+  struct msghdr msg;
+  char *out;      // staging for replies read from reply.fd
+  size_t out_len;
+  size_t out_sent;
+};
+
+static slab_t conn_slab = SLAB_INITIALIZER("io_uring connections", sizeof(uring_conn_t));
+static slab_t reply_slab = SLAB_INITIALIZER("io_uring reply buffers", REPLY_BUFFER_SIZE);
+
+typedef struct uring_loop_s uring_loop_t;
+struct uring_loop_s {
+  pthread_t pid;
+  int ring_fd;
+  int listenfd;
+
+  bool stopped;   // accept cancelled after a handoff
+
+  // connections whose append is written but not visible yet
+  uring_conn_t *parked;
+  // connections whose recv found every buffer in use
+  uring_conn_t *starved;
+  bool timeout_armed;
+  struct __kernel_timespec timeout;
+
+  // submission queue, we are the only producer
+  void *sq_ptr;
+  size_t sq_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail;
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  // completion queue
+  void *cq_ptr;
+  size_t cq_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // provided receive buffers
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buf_base;
+  unsigned short buf_tail;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_submit(uring_loop_t *loop, unsigned wait_nr)
+{
+  __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+  while (1) {
+    int rc = sys_io_uring_enter(loop->ring_fd, loop->to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0 && errno == EINTR) {
+      // a handoff interrupts the wait, let the loop look at draining
+      if (wait_nr > 0) return 0;
+      continue;
+    }
+    if (rc >= 0) loop->to_submit -= rc;
+    return rc;
+  }
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_loop_t *loop)
+{
+  unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+  if (loop->sqe_tail - head >= loop->sq_entries) {
+    // ring is full, hand what we have to the kernel first
+    uring_submit(loop, 0);
+    head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if (loop->sqe_tail - head >= loop->sq_entries) return NULL;
+  }
+
+  unsigned index = loop->sqe_tail & loop->sq_mask;
+  struct io_uring_sqe *sqe = &loop->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  loop->sq_array[index] = index;
+  loop->sqe_tail++;
+  loop->to_submit++;
+  return sqe;
+}
+
+static void uring_recycle_buffer(uring_loop_t *loop, unsigned short bid)
+{
+  struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (RECV_BUFFERS - 1)];
+  buf->addr = (uintptr_t) (loop->buf_base + (size_t) bid * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  loop->buf_tail++;
+  __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void queue_accept(uring_loop_t *loop)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(loop);
+  if (NULL == sqe) return;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = OP_ACCEPT;
+}
+
+// Stops the multishot accept, the loop leaves the accepters once the
+// cancel completed, after every connection it accepted
+static void cancel_accept(uring_loop_t *loop)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(loop);
+  if (NULL == sqe) return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = OP_ACCEPT;
+  sqe->user_data = OP_CANCEL;
+  loop->stopped = true;
+}
+
+// Frees the connection once its socket is closed or handed over
+static void conn_free(uring_conn_t *conn)
+{
+  metrics_connection(-1);
+  line_parser_free(&conn->parser);
+  aesd_log_reply_free(&conn->reply);
+  slab_put(&reply_slab, conn->out);
+  slab_put(&conn_slab, conn);
+}
+
+static void handle_close(uring_conn_t *conn)
+{
+  ALOG(LOG_DAEMON | LOG_INFO, "Closed connection from %s", conn->client_ip);
+  conn_free(conn);
+}
+
+static void queue_op(uring_loop_t *loop, uring_conn_t *conn, enum uring_op op,
+                     int fd, const void *addr, unsigned len, uint64_t off)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(loop);
+  if (NULL == sqe) {
+    // can only happen when the kernel stops consuming, give up on the
+    // client, nothing else is in flight for it
+    syslog(LOG_ERR, "io_uring submission queue full");
+    close(conn->c);
+    handle_close(conn);
+    return;
+  }
+
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = (uintptr_t) conn | op;
+  switch (op) {
+    case OP_RECV:
+      sqe->opcode = IORING_OP_RECV;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = BUFFER_GROUP;
+      break;
+    case OP_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      break;
+    case OP_READ:
+      sqe->opcode = IORING_OP_READ;
+      break;
+    case OP_SEND:
+      sqe->opcode = IORING_OP_SEND;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      break;
+    case OP_SENDMSG:
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      break;
+    case OP_CLOSE:
+    default:
+      sqe->opcode = IORING_OP_CLOSE;
+      break;
+  }
+}
+
+static void queue_recv(uring_loop_t *loop, uring_conn_t *conn)
+{
+  queue_op(loop, conn, OP_RECV, conn->c, NULL, RECV_BUFFER_SIZE, 0);
+}
+
+static void queue_close(uring_loop_t *loop, uring_conn_t *conn)
+{
+  queue_op(loop, conn, OP_CLOSE, conn->c, NULL, 0, 0);
+}
+
+static void conn_reply_done(uring_loop_t *loop, uring_conn_t *conn);
+
+// Queues the next chunk of the reply: straight from the snapshot when it
+// is in memory, otherwise read from the log into conn->out first
+static void queue_reply(uring_loop_t *loop, uring_conn_t *conn)
+{
+  aesd_log_reply_t *reply = &conn->reply;
+
+  if (aesd_log_reply_done(reply)) {
+    aesd_log_reply_sent(reply);
+    aesd_log_reply_free(reply);
+    conn_reply_done(loop, conn);
+    return;
+  }
+  if (reply->head_sent < reply->head_len) {
+    queue_op(loop, conn, OP_SEND, conn->c, reply->head + reply->head_sent,
+             reply->head_len - reply->head_sent, 0);
+    return;
+  }
+  size_t want = reply->end - reply->pos;
+  if (NULL != reply->data) {
+    if (want > REPLY_BUFFER_SIZE) want = REPLY_BUFFER_SIZE;
+    queue_op(loop, conn, OP_SEND, conn->c, reply->data + reply->pos, want, 0);
+  } else if (reply->iovcnt > 0) {
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = aesd_log_reply_iov(reply, conn->iov);
+    queue_op(loop, conn, OP_SENDMSG, conn->c, &conn->msg, 1, 0);
+  } else {
+    if (want > REPLY_BUFFER_SIZE) want = REPLY_BUFFER_SIZE;
+    queue_op(loop, conn, OP_READ, reply->fd, conn->out, want, reply->pos);
+  }
+}
+
+static void queue_send(uring_loop_t *loop, uring_conn_t *conn)
+{
+  queue_op(loop, conn, OP_SEND, conn->c, conn->out + conn->out_sent,
+           conn->out_len - conn->out_sent, 0);
+}
+
+// Snapshots the log, or only what follows `from` when that isn't negative
+static void conn_start_reply(uring_loop_t *loop, uring_conn_t *conn,
+                             const struct aesd_seekto *seekto, off_t from)
+{
+  if (conn->line_start != 0) {
+    metrics_since(HIST_INGEST, conn->line_start);
+    conn->line_start = 0;
+  }
+  aesd_log_reply_free(&conn->reply);
+  int rc = (from >= 0) ? aesd_log_snapshot_from(&conn->reply, from)
+                       : aesd_log_snapshot(&conn->reply, seekto);
+  if (rc == 0) rc = finish_reply(conn->compress, &conn->reply);
+  if (rc < 0) {
+    queue_close(loop, conn);
+    return;
+  }
+  if (conn->reply.fd >= 0 && NULL == conn->out) {
+    conn->out = slab_get(&reply_slab);
+    if (NULL == conn->out) {
+      queue_close(loop, conn);
+      return;
+    }
+  }
+  queue_reply(loop, conn);
+}
+
+static void queue_log_write(uring_loop_t *loop, uring_conn_t *conn)
+{
+  queue_op(loop, conn, OP_WRITE, aesd_log_fd(),
+           conn->write_data + conn->write_done,
+           conn->write_len - conn->write_done, conn->write_off + conn->write_done);
+}
+
+// Appends a line, or the partial line left behind by a closing client.
+// With an offset addressed log file the write goes through the ring into
+// a reserved range, otherwise it's appended right here.
+static void conn_append(uring_loop_t *loop, uring_conn_t *conn, const char *data, size_t len)
+{
+  if (aesd_log_fd() < 0 || aesd_log_reserve(len, &conn->write_off) < 0) {
+    aesd_log_append_direct(data, len);
+    if (conn->closing) queue_close(loop, conn);
+    else conn_start_reply(loop, conn, NULL, -1);
+    return;
+  }
+  conn->write_data = data;
+  conn->write_len = len;
+  conn->write_done = 0;
+  queue_log_write(loop, conn);
+}
+
+// Seek commands are answered right away, data lines are appended first
+static void conn_handle_line(uring_loop_t *loop, uring_conn_t *conn,
+                             const char *line, size_t len)
+{
+  struct aesd_seekto seekto;
+  off_t from;
+
+  metrics_add(COUNTER_LINES, 1);
+  if (line_too_long(len)) {
+    ALOG(LOG_WARNING, "Dropping a %zu byte line from %s", len, conn->client_ip);
+    queue_close(loop, conn);
+    return;
+  }
+  if (parse_seekto(line, len, &seekto)) {
+    FK_DEBUG("GOT COMMAND %u,%u\n", seekto.write_cmd, seekto.write_cmd_offset);
+    conn_start_reply(loop, conn, &seekto, -1);
+  } else if (parse_readfrom(line, len, &from)) {
+    FK_DEBUG("READ FROM %lld\n", (long long) from);
+    conn_start_reply(loop, conn, NULL, from);
+  } else if (parse_compress(line, len, &conn->compress)) {
+    FK_DEBUG("COMPRESS %d\n", conn->compress);
+    conn_start_reply(loop, conn, NULL, -1);
+  } else if (parse_subscribe(line, len)) {
+    // nothing of the connection is in flight, the tail thread takes the
+    // socket and lines pipelined behind this one are dropped
+    if (tail_subscribe(conn->c, conn->client_ip) < 0) {
+      queue_close(loop, conn);
+      return;
+    }
+    conn_free(conn);
+  } else if (!limit_line(conn->addr, len)) {
+    ALOG(LOG_WARNING, "Dropping a %zu byte line, %s is over its rate", len, conn->client_ip);
+    queue_close(loop, conn);
+  } else {
+    conn->line_start = metrics_now();
+    conn_append(loop, conn, line, len);
+  }
+}
+
+// Serves the next pipelined line or waits for more data
+static void conn_next_line(uring_loop_t *loop, uring_conn_t *conn)
+{
+  size_t len;
+  const char *line = line_parser_next(&conn->parser, &len);
+  if (NULL != line) {
+    conn_handle_line(loop, conn, line, len);
+    return;
+  }
+  // the \n is still to come
+  line_parser_pending(&conn->parser, &len);
+  if (line_too_long(len + 1)) {
+    ALOG(LOG_WARNING, "Dropping a line of more than %zu bytes from %s",
+         config.max_line, conn->client_ip);
+    queue_close(loop, conn);
+  } else {
+    queue_recv(loop, conn);
+  }
+}
+
+static void conn_reply_done(uring_loop_t *loop, uring_conn_t *conn)
+{
+  if (config.keepalive) {
+    conn_next_line(loop, conn);
+  } else {
+    queue_close(loop, conn);
+  }
+}
+
+static void handle_accept(uring_loop_t *loop, struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->stopped) {
+    // the multishot accept was terminated, arm it again
+    queue_accept(loop);
+  }
+  if (cqe->res < 0) {
+    FK_DEBUG("accept failed: %d\n", -cqe->res);
+    return;
+  }
+  // the multishot accept has no room for the address
+  struct sockaddr_in client_ca = { 0 };
+  socklen_t len_client_ca = sizeof(client_ca);
+  getpeername(cqe->res, (struct sockaddr *) &client_ca, &len_client_ca);
+  if (!limit_accept(client_ca.sin_addr.s_addr)) {
+    ALOG(LOG_DAEMON | LOG_INFO, "Refusing a connection, the client is over its rate");
+    close(cqe->res);
+    return;
+  }
+
+  uring_conn_t *conn = slab_get(&conn_slab);
+  if (NULL == conn) {
+    close(cqe->res);
+    return;
+  }
+  memset(conn, 0, sizeof(*conn));
+  conn->c = cqe->res;
+  conn->addr = client_ca.sin_addr.s_addr;
+  conn->accepted = metrics_now();
+  conn_tune(conn->c);
+  line_parser_init(&conn->parser);
+  inet_ntop(AF_INET, &client_ca.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+  ALOG(LOG_DAEMON | LOG_INFO, "Accepted connection from %s", conn->client_ip);
+  metrics_connection(1);
+  queue_recv(loop, conn);
+}
+
+static void queue_timeout(uring_loop_t *loop);
+
+// All buffers are in use, the recv is only queued again once one came
+// back. Buffers recycled before the ENOBUFS was seen don't wake anyone,
+// the parked timeout retries one connection for those, its own recycle
+// wakes the next.
+static void conn_starve(uring_loop_t *loop, uring_conn_t *conn)
+{
+  conn->next_starved = loop->starved;
+  loop->starved = conn;
+  queue_timeout(loop);
+}
+
+static void wake_starved(uring_loop_t *loop)
+{
+  uring_conn_t *conn = loop->starved;
+  if (NULL == conn) return;
+  loop->starved = conn->next_starved;
+  queue_recv(loop, conn);
+}
+
+static void handle_recv(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+  if (cqe->res == -ENOBUFS) {
+    conn_starve(loop, conn);
+    return;
+  }
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+      queue_recv(loop, conn);
+    } else if (cqe->res == 0 && conn->parser.end > conn->parser.start) {
+      // client went away in the middle of a line, keep what we got like
+      // the threaded server does
+      size_t len;
+      const char *partial = line_parser_pending(&conn->parser, &len);
+      conn->closing = true;
+      conn_append(loop, conn, partial, len);
+    } else {
+      queue_close(loop, conn);
+    }
+    return;
+  }
+
+  unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  const char *buffer = loop->buf_base + (size_t) bid * RECV_BUFFER_SIZE;
+  size_t bytes_read = cqe->res > 0 ? cqe->res : 0;
+  if (conn->accepted != 0) {
+    metrics_since(HIST_FIRST_BYTE, conn->accepted);
+    conn->accepted = 0;
+  }
+  metrics_add(COUNTER_BYTES_IN, bytes_read);
+
+  int rc = line_parser_feed(&conn->parser, buffer, bytes_read);
+  uring_recycle_buffer(loop, bid);
+  // the buffer goes to one connection that was waiting for it
+  wake_starved(loop);
+
+  if (rc < 0 || bytes_read == 0) {
+    queue_close(loop, conn);
+  } else {
+    conn_next_line(loop, conn);
+  }
+}
+
+// Nothing of ours might complete while the other writers finish, make
+// sure the loop wakes up to look at the parked connections again
+static void queue_timeout(uring_loop_t *loop)
+{
+  if (loop->timeout_armed) return;
+  struct io_uring_sqe *sqe = uring_get_sqe(loop);
+  if (NULL == sqe) return;   // the next completion checks them as well
+
+  loop->timeout.tv_sec = 0;
+  loop->timeout.tv_nsec = PARKED_POLL_NS;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) &loop->timeout;
+  sqe->len = 1;
+  sqe->user_data = OP_TIMEOUT;
+  loop->timeout_armed = true;
+}
+
+static void conn_park(uring_loop_t *loop, uring_conn_t *conn)
+{
+  conn->next_parked = loop->parked;
+  loop->parked = conn;
+  queue_timeout(loop);
+}
+
+// Starts the replies of parked connections whose appends became visible
+static void check_parked(uring_loop_t *loop)
+{
+  uring_conn_t **link = &loop->parked;
+  while (NULL != *link) {
+    uring_conn_t *conn = *link;
+    if (aesd_log_committed(conn->write_off + conn->write_len)) {
+      *link = conn->next_parked;
+      conn_start_reply(loop, conn, NULL, -1);
+    } else {
+      link = &conn->next_parked;
+    }
+  }
+}
+
+static void handle_write(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+  if (cqe->res > 0 && conn->write_done + cqe->res < conn->write_len) {
+    conn->write_done += cqe->res;
+    queue_log_write(loop, conn);
+    return;
+  }
+  if (cqe->res < 0) {
+    FK_DEBUG("\tfailed: %d\n", -cqe->res);
+  }
+  // committed even when it failed, later writers must not wait on it
+  aesd_log_commit(conn->write_off, conn->write_len);
+
+  if (conn->closing) {
+    queue_close(loop, conn);
+  } else if (aesd_log_committed(conn->write_off + conn->write_len)) {
+    conn_start_reply(loop, conn, NULL, -1);
+  } else {
+    conn_park(loop, conn);
+  }
+}
+
+static void handle_timeout(uring_loop_t *loop)
+{
+  loop->timeout_armed = false;
+  check_parked(loop);
+  wake_starved(loop);
+  if (NULL != loop->parked || NULL != loop->starved) queue_timeout(loop);
+}
+
+static void handle_read(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+  if (cqe->res < 0) {
+    queue_close(loop, conn);
+    return;
+  }
+  if (cqe->res == 0) {
+    // the log can't shrink below a snapshot, treat it as done
+    conn->reply.pos = conn->reply.end;
+    queue_reply(loop, conn);
+    return;
+  }
+  conn->reply.pos += cqe->res;
+  conn->out_len = cqe->res;
+  conn->out_sent = 0;
+  queue_send(loop, conn);
+}
+
+static void handle_send(uring_loop_t *loop, uring_conn_t *conn, struct io_uring_cqe *cqe)
+{
+  if (cqe->res < 0) {
+    queue_close(loop, conn);
+    return;
+  }
+  if (conn->reply.head_sent < conn->reply.head_len) {
+    conn->reply.head_sent += cqe->res;
+    queue_reply(loop, conn);
+    return;
+  }
+  if (NULL != conn->reply.data || conn->reply.iovcnt > 0) {
+    conn->reply.pos += cqe->res;
+    queue_reply(loop, conn);
+    return;
+  }
+  conn->out_sent += cqe->res;
+  if (conn->out_sent < conn->out_len) {
+    queue_send(loop, conn);
+  } else {
+    queue_reply(loop, conn);
+  }
+}
+
+static void handle_cqe(uring_loop_t *loop, struct io_uring_cqe *cqe)
+{
+  enum uring_op op = cqe->user_data & OP_MASK;
+  uring_conn_t *conn = (uring_conn_t *) (uintptr_t) (cqe->user_data & ~OP_MASK);
+
+  switch (op) {
+    case OP_ACCEPT:
+      handle_accept(loop, cqe);
+      break;
+    case OP_RECV:
+      handle_recv(loop, conn, cqe);
+      break;
+    case OP_WRITE:
+      handle_write(loop, conn, cqe);
+      break;
+    case OP_READ:
+      handle_read(loop, conn, cqe);
+      break;
+    case OP_SEND:
+    case OP_SENDMSG:
+      handle_send(loop, conn, cqe);
+      break;
+    case OP_CLOSE:
+      handle_close(conn);
+      break;
+    case OP_TIMEOUT:
+      handle_timeout(loop);
+      break;
+    case OP_CANCEL:
+      accept_loop_leave();
+      break;
+  }
+}
+
+static void *uring_loop(void *arg)
+{
+  uring_loop_t *loop = (uring_loop_t *) arg;
+
+  accept_loop_enter();
+  queue_accept(loop);
+  while (!got_signal) {
+    if (draining && !loop->stopped) cancel_accept(loop);
+    // submit everything queued by the last batch and wait for more work
+    if (uring_submit(loop, 1) < 0) {
+      syslog(LOG_ERR, "io_uring_enter failed: %d", errno);
+      break;
+    }
+
+    unsigned head = *loop->cq_head;
+    unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      handle_cqe(loop, &loop->cqes[head & loop->cq_mask]);
+      head++;
+      if (head == tail) {
+        // completions that arrived while handling this batch
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+      }
+    }
+    __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    check_parked(loop);
+  }
+  return NULL;
+}
+
+static void uring_teardown(uring_loop_t *loop)
+{
+  if (NULL != loop->buf_ring) munmap(loop->buf_ring, loop->buf_ring_size);
+  free(loop->buf_base);
+  if (NULL != loop->sqes) munmap(loop->sqes, loop->sqes_size);
+  if (NULL != loop->cq_ptr && loop->cq_ptr != loop->sq_ptr) munmap(loop->cq_ptr, loop->cq_size);
+  if (NULL != loop->sq_ptr) munmap(loop->sq_ptr, loop->sq_size);
+  if (loop->ring_fd >= 0) close(loop->ring_fd);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Creates the ring and registers the receive buffers.
+// Returns -1 when io_uring or one of the features we need is missing.
+static int uring_setup(uring_loop_t *loop, int listenfd)
+{
+  struct io_uring_params p;
+
+  memset(loop, 0, sizeof(*loop));
+  loop->listenfd = listenfd;
+  memset(&p, 0, sizeof(p));
+  loop->ring_fd = sys_io_uring_setup(RING_ENTRIES, &p);
+  if (loop->ring_fd < 0) return -1;
+
+  loop->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  loop->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (loop->cq_size > loop->sq_size) loop->sq_size = loop->cq_size;
+    loop->cq_size = loop->sq_size;
+  }
+  loop->sq_ptr = map_ring(loop->ring_fd, loop->sq_size, IORING_OFF_SQ_RING);
+  if (NULL == loop->sq_ptr) goto ERR_SETUP;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    loop->cq_ptr = loop->sq_ptr;
+  } else {
+    loop->cq_ptr = map_ring(loop->ring_fd, loop->cq_size, IORING_OFF_CQ_RING);
+    if (NULL == loop->cq_ptr) goto ERR_SETUP;
+  }
+  loop->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  loop->sqes = map_ring(loop->ring_fd, loop->sqes_size, IORING_OFF_SQES);
+  if (NULL == loop->sqes) goto ERR_SETUP;
+
+  char *sq = loop->sq_ptr;
+  loop->sq_head = (unsigned *) (sq + p.sq_off.head);
+  loop->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  loop->sq_array = (unsigned *) (sq + p.sq_off.array);
+  loop->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  loop->sq_entries = p.sq_entries;
+  loop->sqe_tail = *loop->sq_tail;
+
+  char *cq = loop->cq_ptr;
+  loop->cq_head = (unsigned *) (cq + p.cq_off.head);
+  loop->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  loop->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  loop->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // provided buffer ring, the kernel picks a buffer when data arrives
+  // so idle connections don't pin any receive memory
+  loop->buf_ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+  loop->buf_ring = mmap(NULL, loop->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (loop->buf_ring == MAP_FAILED) {
+    loop->buf_ring = NULL;
+    goto ERR_SETUP;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) loop->buf_ring;
+  reg.ring_entries = RECV_BUFFERS;
+  reg.bgid = BUFFER_GROUP;
+  if (sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto ERR_SETUP;
+
+  loop->buf_base = malloc((size_t) RECV_BUFFERS * RECV_BUFFER_SIZE);
+  if (NULL == loop->buf_base) goto ERR_SETUP;
+  for (unsigned short bid = 0; bid < RECV_BUFFERS; bid++) {
+    uring_recycle_buffer(loop, bid);
+  }
+  return 0;
+
+ERR_SETUP:
+  FK_DEBUG("io_uring setup failed: %d\n", errno);
+  uring_teardown(loop);
+  return -1;
+}
+
+// Runs `loops` rings, the calling thread drives the first one.
+// Returns 1 without touching the listening socket when io_uring can't be
+// used, or the log would block it, so the caller can fall back to the
+// threaded server, -1 on errors.
+int uring_server_run(int listenfd, int loops)
+{
+  // only the log file is written through the ring, other backends are
+  // appended to inline and must not make the ring wait
+  bool through_ring = aesd_log_fd() >= 0 && NULL != aesd_log_backend()->write_at;
+  if (!through_ring && aesd_log_backend()->blocking) {
+    syslog(LOG_WARNING, "Appends to the %s log can block, not serving from io_uring",
+           aesd_log_backend()->name);
+    return 1;
+  }
+
+  uring_loop_t *loop_data = calloc(loops, sizeof(uring_loop_t));
+  if (NULL == loop_data) return -1;
+
+  for (int i = 0; i < loops; i++) {
+    if (uring_setup(&loop_data[i], listenfd) < 0) {
+      syslog(LOG_WARNING, "io_uring not available: %d", errno);
+      while (i-- > 0) uring_teardown(&loop_data[i]);
+      free(loop_data);
+      return 1;
+    }
+  }
+
+  for (int i = 1; i < loops; i++) {
+    if (pthread_create(&loop_data[i].pid, NULL, &uring_loop, &loop_data[i]) != 0) {
+      syslog(LOG_ERR, "Error creating io_uring loop %d: %d", i, errno);
+      return -1;
+    }
+  }
+  syslog(LOG_DAEMON, "Serving with %d io_uring loop(s)", loops);
+  uring_loop(&loop_data[0]);
+  return -1;
+}
+
+#else
+
+int uring_server_run(int listenfd, int loops)
+{
+  syslog(LOG_WARNING, "Built without io_uring support");
+  return 1;
+}
+
+#endif
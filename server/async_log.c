@@ -0,0 +1,132 @@
+#include "aesdsocket.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <stdarg.h>
+#include <time.h>
+
+#define QUEUE_SLOTS 1024              // power of 2
+#define MESSAGE_SIZE 240
+#define DRAIN_INTERVAL_NS (20 * 1000 * 1000)
+
+// Bounded multi-producer queue with a sequence number per slot (Vyukov):
+// a slot is free for the producer at position pos when its seq is pos,
+// and ready for the consumer when it is pos + 1
+typedef struct log_slot_s log_slot_t;
+struct log_slot_s {
+  uint64_t seq;
+  int priority;
+  char message[MESSAGE_SIZE];
+};
+
+static log_slot_t slots[QUEUE_SLOTS];
+static uint64_t enqueue_pos = 0;
+static uint64_t dequeue_pos = 0;    // drainer_lock
+static unsigned long dropped = 0;   // queue full or over the rate
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drainer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// token bucket of the drainer
+static int rate_limit = 0;
+static double tokens = 0;
+static uint64_t refilled = 0;
+
+static void slots_setup(void)
+{
+  for (uint64_t i = 0; i < QUEUE_SLOTS; i++) slots[i].seq = i;
+}
+
+void async_log(int priority, const char *fmt, ...)
+{
+  uint64_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  log_slot_t *slot;
+  va_list args;
+
+  pthread_once(&slots_once, &slots_setup);
+  while (1) {
+    slot = &slots[pos & (QUEUE_SLOTS - 1)];
+    int64_t diff = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // the drainer is a whole queue behind
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->priority = priority;
+  va_start(args, fmt);
+  vsnprintf(slot->message, sizeof(slot->message), fmt, args);
+  va_end(args);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// False when the message is over the rate limit
+static bool rate_take(uint64_t now)
+{
+  if (rate_limit <= 0) return true;
+  tokens += (double) (now - refilled) * rate_limit / 1e9;
+  if (tokens > rate_limit) tokens = rate_limit;
+  refilled = now;
+  if (tokens < 1) return false;
+  tokens -= 1;
+  return true;
+}
+
+// Forwards every ready message, drainer_lock held
+static void drain(void)
+{
+  uint64_t now = metrics_now();
+
+  while (1) {
+    log_slot_t *slot = &slots[dequeue_pos & (QUEUE_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1) break;
+    if (rate_take(now)) syslog(slot->priority, "%s", slot->message);
+    else __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, dequeue_pos + QUEUE_SLOTS, __ATOMIC_RELEASE);
+    dequeue_pos++;
+  }
+
+  unsigned long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (lost > 0) syslog(LOG_WARNING, "Dropped %lu log messages", lost);
+}
+
+void async_log_flush(void)
+{
+  // waits for a drain in progress, what it leaves is ours
+  pthread_mutex_lock(&drainer_lock);
+  pthread_once(&slots_once, &slots_setup);
+  drain();
+  pthread_mutex_unlock(&drainer_lock);
+}
+
+static void *drainer(void *arg)
+{
+  struct timespec interval = { .tv_nsec = DRAIN_INTERVAL_NS };
+
+  while (1) {
+    pthread_mutex_lock(&drainer_lock);
+    drain();
+    pthread_mutex_unlock(&drainer_lock);
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+int async_log_start(int rate)
+{
+  pthread_t pid;
+
+  pthread_once(&slots_once, &slots_setup);
+  rate_limit = rate;
+  tokens = rate;
+  refilled = metrics_now();
+  if (pthread_create(&pid, NULL, &drainer, NULL) != 0) return -1;
+  pthread_detach(pid);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _ASYNC_LOG__H_
+#define _ASYNC_LOG__H_
+
+#include <syslog.h>
+
+// syslog() off the connection paths. Messages are formatted into a
+// bounded lock-free queue and a background thread hands them to syslog
+// in batches. A full queue drops the message instead of waiting, the
+// drainer reports how many were lost.
+
+// levels above this are compiled out, -DASYNC_LOG_LEVEL=LOG_NOTICE drops
+// the per connection messages
+#ifndef ASYNC_LOG_LEVEL
+#define ASYNC_LOG_LEVEL LOG_INFO
+#endif
+
+#define ALOG(priority, ...) do { \
+    if (LOG_PRI(priority) <= ASYNC_LOG_LEVEL) async_log(priority, __VA_ARGS__); \
+  } while (0)
+
+void async_log(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Starts the drainer, at most `rate` messages per second reach syslog,
+// 0 for no limit
+int async_log_start(int rate);
+// Hands everything queued to syslog right away, for the shutdown paths.
+// Not async-signal-safe, never call it from a signal handler.
+void async_log_flush(void);
+
+#endif
@@ -0,0 +1,101 @@
+#include "line_parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+static slab_t chunk_slab = SLAB_INITIALIZER("line buffers", LINE_PARSER_CHUNK);
+
+void line_parser_init(line_parser_t *parser)
+{
+  memset(parser, 0, sizeof(*parser));
+}
+
+void line_parser_free(line_parser_t *parser)
+{
+  if (parser->pooled) slab_put(&chunk_slab, parser->buf);
+  else free(parser->buf);
+  memset(parser, 0, sizeof(*parser));
+}
+
+char *line_parser_space(line_parser_t *parser, size_t want, size_t *avail)
+{
+  // move the partial line to the front before growing the buffer
+  if (parser->start > 0 && parser->size - parser->end < want) {
+    memmove(parser->buf, parser->buf + parser->start, parser->end - parser->start);
+    parser->end -= parser->start;
+    parser->start = 0;
+  }
+
+  if (0 == parser->size && want <= LINE_PARSER_CHUNK) {
+    parser->buf = slab_get(&chunk_slab);
+    if (NULL == parser->buf) return NULL;
+    parser->size = LINE_PARSER_CHUNK;
+    parser->pooled = true;
+  } else if (parser->size - parser->end < want) {
+    size_t size = parser->size ? parser->size : want;
+    while (size - parser->end < want) size *= 2;
+    char *buf;
+    if (parser->pooled) {
+      // long line, move out of the slab
+      buf = malloc(size);
+      if (NULL == buf) return NULL;
+      memcpy(buf, parser->buf, parser->end);
+      slab_put(&chunk_slab, parser->buf);
+      parser->pooled = false;
+    } else {
+      buf = realloc(parser->buf, size);
+      if (NULL == buf) return NULL;
+    }
+    parser->buf = buf;
+    parser->size = size;
+  }
+
+  *avail = parser->size - parser->end;
+  return parser->buf + parser->end;
+}
+
+void line_parser_commit(line_parser_t *parser, size_t len)
+{
+  parser->end += len;
+}
+
+int line_parser_feed(line_parser_t *parser, const char *data, size_t len)
+{
+  size_t avail;
+  char *space = line_parser_space(parser, len, &avail);
+  if (NULL == space) return -1;
+  memcpy(space, data, len);
+  line_parser_commit(parser, len);
+  return 0;
+}
+
+const char *line_parser_next(line_parser_t *parser, size_t *len)
+{
+  char *from = parser->buf + parser->start + parser->scanned;
+  size_t left = parser->end - parser->start - parser->scanned;
+  char *nn = left ? memchr(from, '\n', left) : NULL;
+
+  if (NULL == nn) {
+    // don't scan these bytes again when more data arrives
+    parser->scanned += left;
+    return NULL;
+  }
+
+  const char *line = parser->buf + parser->start;
+  *len = nn - line + 1;
+  parser->start += *len;
+  parser->scanned = 0;
+  if (parser->start == parser->end) {
+    // everything consumed, the next receive starts at the front
+    parser->start = 0;
+    parser->end = 0;
+  }
+  return line;
+}
+
+const char *line_parser_pending(line_parser_t *parser, size_t *len)
+{
+  *len = parser->end - parser->start;
+  return parser->buf + parser->start;
+}
@@ -0,0 +1,41 @@
+#ifndef _LINE_PARSER__H_
+#define _LINE_PARSER__H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// the first buffer of every parser comes from a slab of this size
+#define LINE_PARSER_CHUNK (4 * 1024)
+
+// Incremental framing of \n separated lines. Bytes are received straight
+// into the parser buffer, complete lines are handed out in order and
+// whatever follows the last \n is kept for the next receive.
+typedef struct line_parser_s line_parser_t;
+struct line_parser_s {
+  char *buf;
+  size_t size;
+  size_t start;     // first byte of the line being assembled
+  size_t scanned;   // bytes after start already known to have no \n
+  size_t end;       // end of received data
+  bool pooled;      // buf is a LINE_PARSER_CHUNK from the slab
+};
+
+void line_parser_init(line_parser_t *parser);
+void line_parser_free(line_parser_t *parser);
+
+// Returns room for at least `want` bytes at the end of the buffer, the
+// real amount is stored in avail. NULL when out of memory.
+char *line_parser_space(line_parser_t *parser, size_t want, size_t *avail);
+// Marks `len` bytes written to the space returned above as received
+void line_parser_commit(line_parser_t *parser, size_t len);
+// Copies data into the parser, returns -1 when out of memory
+int line_parser_feed(line_parser_t *parser, const char *data, size_t len);
+
+// Returns the next complete line including its \n, or NULL when no
+// complete line is buffered. The line stays valid until the next call to
+// line_parser_space() or line_parser_feed().
+const char *line_parser_next(line_parser_t *parser, size_t *len);
+// Returns the unterminated data received after the last line
+const char *line_parser_pending(line_parser_t *parser, size_t *len);
+
+#endif
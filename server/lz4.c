@@ -0,0 +1,124 @@
+#include "lz4.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+// the last match starts 12 bytes before the end at the latest, the last
+// 5 bytes are always literals
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+// magic, FLG (version 1, independent blocks), BD (64KB blocks) and the
+// header checksum, the second byte of xxh32 over FLG and BD
+const char lz4_frame_header[LZ4_FRAME_HEADER_SIZE] = {
+  0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, (char) 0x82,
+};
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Lengths past the 4 bits of the token continue in bytes of up to 255
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t) len;
+  return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, uint8_t *token, const uint8_t *lit, size_t len)
+{
+  *token = (uint8_t) ((len >= 15 ? 15 : len) << 4);
+  if (len >= 15) op = put_length(op, len - 15);
+  memcpy(op, lit, len);
+  return op + len;
+}
+
+size_t lz4_compress_block(const char *src, size_t len, char *dst)
+{
+  const uint8_t *in = (const uint8_t *) src;
+  const uint8_t *end = in + len;
+  const uint8_t *ip = in;
+  const uint8_t *anchor = in;
+  uint8_t *op = (uint8_t *) dst;
+  uint32_t table[1 << HASH_BITS];
+
+  if (len > MF_LIMIT) {
+    const uint8_t *mf_limit = end - MF_LIMIT;
+    const uint8_t *match_limit = end - LAST_LITERALS;
+
+    memset(table, 0, sizeof(table));
+    ip++;
+    while (ip <= mf_limit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = hash(seq);
+      const uint8_t *ref = in + table[h];
+      table[h] = (uint32_t) (ip - in);
+      if (ip - ref > MAX_OFFSET || read32(ref) != seq) {
+        // skip faster through data that doesn't compress
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *mp = ip + MIN_MATCH;
+      const uint8_t *rp = ref + MIN_MATCH;
+      while (mp < match_limit && *mp == *rp) {
+        mp++;
+        rp++;
+      }
+
+      uint8_t *token = op++;
+      op = put_literals(op, token, anchor, ip - anchor);
+      size_t offset = ip - ref;
+      *op++ = (uint8_t) offset;
+      *op++ = (uint8_t) (offset >> 8);
+      size_t match_len = mp - ip - MIN_MATCH;
+      *token |= (uint8_t) (match_len >= 15 ? 15 : match_len);
+      if (match_len >= 15) op = put_length(op, match_len - 15);
+
+      ip = mp;
+      anchor = ip;
+    }
+  }
+
+  uint8_t *token = op++;
+  op = put_literals(op, token, anchor, end - anchor);
+  return op - (uint8_t *) dst;
+}
+
+static void put32(char *p, uint32_t v)
+{
+  p[0] = (char) v;
+  p[1] = (char) (v >> 8);
+  p[2] = (char) (v >> 16);
+  p[3] = (char) (v >> 24);
+}
+
+size_t lz4_frame_block(const char *src, size_t len, char *dst)
+{
+  size_t n = lz4_compress_block(src, len, dst + 4);
+  if (n >= len) {
+    memcpy(dst + 4, src, len);
+    put32(dst, (uint32_t) len | LZ4_BLOCK_UNCOMPRESSED);
+    return 4 + len;
+  }
+  put32(dst, (uint32_t) n);
+  return 4 + n;
+}
@@ -0,0 +1,28 @@
+#ifndef _LZ4__H_
+#define _LZ4__H_
+
+#include <stddef.h>
+
+// Just enough of LZ4 to write frames any lz4 decoder reads: a greedy
+// single pass block compressor and the frame constants. Frames use
+// independent 64KB blocks without checksums.
+
+#define LZ4_BLOCK_MAX (64 * 1024)
+// worst case compressed size of n bytes
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+#define LZ4_FRAME_HEADER_SIZE 7
+extern const char lz4_frame_header[LZ4_FRAME_HEADER_SIZE];
+// size field of a block stored as is
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+
+// Compresses len bytes (at most LZ4_BLOCK_MAX) into dst, which has room
+// for LZ4_BOUND(len). Returns the compressed size.
+size_t lz4_compress_block(const char *src, size_t len, char *dst);
+
+// Writes one frame block: the little endian size and the data, stored
+// uncompressed when that is smaller. dst needs 4 + LZ4_BOUND(len).
+// Returns the bytes written.
+size_t lz4_frame_block(const char *src, size_t len, char *dst);
+
+#endif
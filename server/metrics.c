@@ -0,0 +1,352 @@
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+#define DUMP_SIZE 4096
+
+static const char *hist_names[HIST_COUNT] = {
+  [HIST_FIRST_BYTE] = "first_byte_ns",
+  [HIST_INGEST] = "ingest_ns",
+  [HIST_LOCK_WAIT] = "lock_wait_ns",
+  [HIST_LOCK_HOLD] = "lock_hold_ns",
+  [HIST_REPLY_SIZE] = "reply_bytes",
+  [HIST_REPLY_TIME] = "reply_ns",
+};
+
+// Only the owning thread writes a shard, relaxed stores keep concurrent
+// readers from seeing torn values
+typedef struct metrics_shard_s metrics_shard_t;
+struct metrics_shard_s {
+  uint64_t buckets[HIST_COUNT][HIST_BUCKETS];
+  uint64_t sum[HIST_COUNT];
+  uint64_t max[HIST_COUNT];
+  uint64_t counters[COUNTER_COUNT];
+  metrics_shard_t *next;
+  metrics_shard_t *free_next;   // while no thread owns it
+};
+
+// Shards of every thread so far, never freed. An exiting thread puts its
+// shard on the free list and the next new thread carries on counting in
+// it, so a thread per connection does not allocate one per connection.
+static metrics_shard_t *shards = NULL;
+static metrics_shard_t *free_shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread metrics_shard_t *shard = NULL;
+
+static long connections = 0;
+static const char *socket_path = NULL;
+
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void shard_merge(metrics_shard_t *into, metrics_shard_t *from)
+{
+  for (int h = 0; h < HIST_COUNT; h++) {
+    for (int b = 0; b < HIST_BUCKETS; b++) into->buckets[h][b] += LOAD(from->buckets[h][b]);
+    into->sum[h] += LOAD(from->sum[h]);
+    uint64_t max = LOAD(from->max[h]);
+    if (max > into->max[h]) into->max[h] = max;
+  }
+  for (int c = 0; c < COUNTER_COUNT; c++) into->counters[c] += LOAD(from->counters[c]);
+}
+
+static void shard_release(void *arg)
+{
+  metrics_shard_t *dead = (metrics_shard_t *) arg;
+
+  pthread_mutex_lock(&shards_lock);
+  dead->free_next = free_shards;
+  free_shards = dead;
+  pthread_mutex_unlock(&shards_lock);
+}
+
+static void shards_setup(void)
+{
+  pthread_key_create(&shard_key, &shard_release);
+}
+
+// Returns the calling thread's shard, NULL when out of memory
+static metrics_shard_t *shard_get(void)
+{
+  if (NULL != shard) return shard;
+
+  pthread_once(&shards_once, &shards_setup);
+  pthread_mutex_lock(&shards_lock);
+  metrics_shard_t *mine = free_shards;
+  if (NULL != mine) free_shards = mine->free_next;
+  pthread_mutex_unlock(&shards_lock);
+  if (NULL == mine) {
+    mine = calloc(1, sizeof(metrics_shard_t));
+    if (NULL == mine) return NULL;
+    pthread_mutex_lock(&shards_lock);
+    mine->next = shards;
+    shards = mine;
+    pthread_mutex_unlock(&shards_lock);
+  }
+  pthread_setspecific(shard_key, mine);
+  shard = mine;
+  return shard;
+}
+
+static int bucket_index(uint64_t value)
+{
+  if (value < SUB_BUCKETS) return value;
+  int msb = 63 - __builtin_clzll(value);
+  return (msb - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Lowest value that lands in bucket index
+static uint64_t bucket_low(int index)
+{
+  if (index < SUB_BUCKETS) return index;
+  int msb = index / SUB_BUCKETS + SUB_BITS - 1;
+  return (uint64_t) (SUB_BUCKETS + index % SUB_BUCKETS) << (msb - SUB_BITS);
+}
+
+uint64_t metrics_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_record(enum metric_hist hist, uint64_t value)
+{
+  metrics_shard_t *s = shard_get();
+  if (NULL == s) return;
+
+  BUMP(s->buckets[hist][bucket_index(value)], 1);
+  BUMP(s->sum[hist], value);
+  if (value > s->max[hist]) __atomic_store_n(&s->max[hist], value, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metric_counter counter, uint64_t n)
+{
+  metrics_shard_t *s = shard_get();
+  if (NULL != s) BUMP(s->counters[counter], n);
+}
+
+void metrics_connection(int delta)
+{
+  __atomic_add_fetch(&connections, delta, __ATOMIC_RELAXED);
+  if (delta > 0) metrics_add(COUNTER_ACCEPTED, delta);
+}
+
+long metrics_connections(void)
+{
+  return __atomic_load_n(&connections, __ATOMIC_RELAXED);
+}
+
+// Value at quantile q of a merged histogram, the top of its bucket
+static uint64_t hist_quantile(const metrics_shard_t *total, int hist, uint64_t count, double q)
+{
+  uint64_t rank = (uint64_t) (q * count + 0.5);
+  uint64_t seen = 0;
+
+  if (rank < 1) rank = 1;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += total->buckets[hist][b];
+    if (seen >= rank) {
+      uint64_t top = (b + 1 < HIST_BUCKETS) ? bucket_low(b + 1) - 1 : UINT64_MAX;
+      return top < total->max[hist] ? top : total->max[hist];
+    }
+  }
+  return total->max[hist];
+}
+
+// Threads: line of /proc/self/status, -1 when it can't be read
+static long thread_count(void)
+{
+  char line[128];
+  long threads = -1;
+
+  FILE *status = fopen("/proc/self/status", "re");
+  if (NULL == status) return -1;
+  while (NULL != fgets(line, sizeof(line), status)) {
+    if (sscanf(line, "Threads: %ld", &threads) == 1) break;
+  }
+  fclose(status);
+  return threads;
+}
+
+size_t metrics_format(char *buf, size_t size)
+{
+  metrics_shard_t *total = calloc(1, sizeof(metrics_shard_t));
+  size_t len = 0;
+  bool full = false;    // a line did not fit, it and the rest are left out
+
+  if (NULL == total) return 0;
+  pthread_mutex_lock(&shards_lock);
+  for (metrics_shard_t *s = shards; NULL != s; s = s->next) shard_merge(total, s);
+  pthread_mutex_unlock(&shards_lock);
+
+#define APPEND(...) do { \
+    if (!full) { \
+      int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+      if (n < 0 || (size_t) n >= size - len) full = true; \
+      else len += n; \
+    } \
+  } while (0)
+
+  APPEND("connections %ld active, %llu accepted\n",
+         __atomic_load_n(&connections, __ATOMIC_RELAXED),
+         (unsigned long long) total->counters[COUNTER_ACCEPTED]);
+  APPEND("threads %ld\n", thread_count());
+  APPEND("lines %llu\n", (unsigned long long) total->counters[COUNTER_LINES]);
+  APPEND("bytes %llu in, %llu out\n",
+         (unsigned long long) total->counters[COUNTER_BYTES_IN],
+         (unsigned long long) total->counters[COUNTER_BYTES_OUT]);
+  APPEND("tail %llu bytes out, %llu dropped\n",
+         (unsigned long long) total->counters[COUNTER_TAIL_OUT],
+         (unsigned long long) total->counters[COUNTER_TAIL_DROPPED]);
+  APPEND("limited %llu connections, %llu lines\n",
+         (unsigned long long) total->counters[COUNTER_LIMITED_CONNS],
+         (unsigned long long) total->counters[COUNTER_LIMITED_LINES]);
+  for (int h = 0; h < HIST_COUNT; h++) {
+    uint64_t count = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) count += total->buckets[h][b];
+    if (count == 0) {
+      APPEND("%s count 0\n", hist_names[h]);
+      continue;
+    }
+    APPEND("%s count %llu mean %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+           hist_names[h], (unsigned long long) count,
+           (unsigned long long) (total->sum[h] / count),
+           (unsigned long long) hist_quantile(total, h, count, 0.5),
+           (unsigned long long) hist_quantile(total, h, count, 0.9),
+           (unsigned long long) hist_quantile(total, h, count, 0.99),
+           (unsigned long long) hist_quantile(total, h, count, 0.999),
+           (unsigned long long) total->max[h]);
+  }
+#undef APPEND
+
+  free(total);
+  return len;
+}
+
+static void metrics_log(void)
+{
+  char dump[DUMP_SIZE];
+  size_t len = metrics_format(dump, sizeof(dump));
+  char *line = dump;
+
+  dump[len] = '\0';
+  while (*line != '\0') {
+    char *end = strchr(line, '\n');
+    if (NULL != end) *end = '\0';
+    syslog(LOG_INFO, "metrics: %s", line);
+    if (NULL == end) break;
+    line = end + 1;
+  }
+  slab_log_stats(LOG_INFO);
+}
+
+static int metrics_listen(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 5) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Every client gets one dump and is closed
+static void metrics_serve(int listenfd)
+{
+  char dump[DUMP_SIZE];
+
+  int c = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+  if (c < 0) return;
+  size_t len = metrics_format(dump, sizeof(dump));
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = send(c, dump + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    sent += n;
+  }
+  close(c);
+}
+
+typedef struct metrics_thread_s metrics_thread_t;
+struct metrics_thread_s {
+  int sigfd;
+  int listenfd;
+};
+
+static void *metrics_thread(void *arg)
+{
+  metrics_thread_t *fds = (metrics_thread_t *) arg;
+  struct pollfd pfd[2] = {
+    { .fd = fds->sigfd, .events = POLLIN },
+    { .fd = fds->listenfd, .events = POLLIN },
+  };
+
+  while (1) {
+    if (poll(pfd, fds->listenfd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "metrics poll failed: %d", errno);
+      break;
+    }
+    if (pfd[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(fds->sigfd, &info, sizeof(info)) == sizeof(info)) metrics_log();
+    }
+    if (fds->listenfd >= 0 && (pfd[1].revents & POLLIN)) metrics_serve(fds->listenfd);
+  }
+  return NULL;
+}
+
+int metrics_start(const char *path)
+{
+  static metrics_thread_t fds = { -1, -1 };
+  pthread_t pid;
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  fds.sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+  if (fds.sigfd < 0) goto ERR_SETUP;
+
+  if (NULL != path) {
+    fds.listenfd = metrics_listen(path);
+    if (fds.listenfd < 0) goto ERR_SETUP;
+    socket_path = path;
+  }
+  if (pthread_create(&pid, NULL, &metrics_thread, &fds) != 0) goto ERR_SETUP;
+  pthread_detach(pid);
+  return 0;
+
+ERR_SETUP:
+  syslog(LOG_ERR, "Error setting up metrics: %d", errno);
+  metrics_cleanup();
+  return -1;
+}
+
+void metrics_cleanup(void)
+{
+  if (NULL != socket_path) unlink(socket_path);
+}
@@ -0,0 +1,59 @@
+#ifndef _METRICS__H_
+#define _METRICS__H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-process counters and latency histograms. Every thread records into
+// a shard of its own without atomics or locks; readers add the shards up.
+// Histograms have log-linear buckets (8 per power of two, so within
+// 12.5%), the same idea as HdrHistogram.
+
+enum metric_hist {
+  HIST_FIRST_BYTE,    // ns from accept() to the first byte of a connection
+  HIST_INGEST,        // ns from a complete line to it being in the log
+  HIST_LOCK_WAIT,     // ns waiting for the log lock
+  HIST_LOCK_HOLD,     // ns the log lock was held
+  HIST_REPLY_SIZE,    // bytes per reply
+  HIST_REPLY_TIME,    // ns from the snapshot to the last byte sent
+  HIST_COUNT,
+};
+
+enum metric_counter {
+  COUNTER_ACCEPTED,   // connections
+  COUNTER_LINES,      // lines and commands handled
+  COUNTER_BYTES_IN,   // read from clients
+  COUNTER_BYTES_OUT,  // sent in replies
+  COUNTER_TAIL_OUT,   // sent to subscribers
+  COUNTER_TAIL_DROPPED, // bytes subscribers skipped for lagging behind
+  COUNTER_LIMITED_CONNS, // connections refused for their rate
+  COUNTER_LIMITED_LINES, // lines refused for their rate
+  COUNTER_COUNT,
+};
+
+// CLOCK_MONOTONIC in ns
+uint64_t metrics_now(void);
+
+void metrics_record(enum metric_hist hist, uint64_t value);
+void metrics_add(enum metric_counter counter, uint64_t n);
+
+// Records the time since start, a metrics_now() value
+static inline void metrics_since(enum metric_hist hist, uint64_t start)
+{
+  metrics_record(hist, metrics_now() - start);
+}
+
+// Tracks connections currently open, delta is +1 or -1
+void metrics_connection(int delta);
+long metrics_connections(void);
+
+// Writes a text dump of everything into buf, returns its length
+size_t metrics_format(char *buf, size_t size);
+
+// Starts the thread that logs the dump on SIGUSR1 and, when path isn't
+// NULL, serves it to every client of a UNIX socket at path. Blocks
+// SIGUSR1 in the calling thread, call it before starting other threads.
+int metrics_start(const char *path);
+void metrics_cleanup(void);
+
+#endif
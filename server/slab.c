@@ -0,0 +1,204 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define SLAB_MAX 8            // slabs that can be in use at the same time
+#define SLAB_CACHE 32         // free objects a thread keeps per slab
+#define SLAB_TRIM_INTERVAL 10 // seconds
+
+typedef struct slab_cache_s slab_cache_t;
+struct slab_cache_s {
+  void *head;
+  int count;
+};
+
+static slab_t *slabs[SLAB_MAX];
+static int slab_count = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static __thread slab_cache_t caches[SLAB_MAX];
+static __thread bool cache_registered = false;
+
+#define NEXT(obj) (*(void **) (obj))
+
+// Moves up to n objects from the cache to the shared list
+static void cache_spill(slab_t *slab, slab_cache_t *cache, int n)
+{
+  pthread_mutex_lock(&slab->lock);
+  while (n-- > 0 && NULL != cache->head) {
+    void *obj = cache->head;
+    cache->head = NEXT(obj);
+    cache->count--;
+    NEXT(obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->free_count++;
+  }
+  pthread_mutex_unlock(&slab->lock);
+}
+
+// Hands the cache of an exiting thread back to the slabs
+static void cache_release(void *arg)
+{
+  slab_cache_t *thread_caches = (slab_cache_t *) arg;
+  int count = __atomic_load_n(&slab_count, __ATOMIC_ACQUIRE);
+
+  for (int id = 0; id < count; id++) {
+    cache_spill(slabs[id], &thread_caches[id], thread_caches[id].count);
+  }
+}
+
+// Frees shared objects the last interval didn't need
+static void slab_trim(slab_t *slab)
+{
+  void *release = NULL;
+
+  pthread_mutex_lock(&slab->lock);
+  long in_use = __atomic_load_n(&slab->in_use, __ATOMIC_RELAXED);
+  long peak = __atomic_exchange_n(&slab->peak, in_use, __ATOMIC_RELAXED);
+  size_t keep = peak > in_use ? peak - in_use : 0;
+  while (slab->free_count > keep) {
+    void *obj = slab->free_list;
+    slab->free_list = NEXT(obj);
+    slab->free_count--;
+    NEXT(obj) = release;
+    release = obj;
+    __atomic_add_fetch(&slab->trimmed, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&slab->lock);
+
+  while (NULL != release) {
+    void *obj = release;
+    release = NEXT(obj);
+    free(obj);
+  }
+}
+
+static void *slab_trimmer(void *arg)
+{
+  while (1) {
+    sleep(SLAB_TRIM_INTERVAL);
+    int count = __atomic_load_n(&slab_count, __ATOMIC_ACQUIRE);
+    for (int id = 0; id < count; id++) slab_trim(slabs[id]);
+    slab_log_stats(LOG_DEBUG);
+  }
+  return NULL;
+}
+
+static void slab_setup(void)
+{
+  pthread_t pid;
+
+  pthread_key_create(&cache_key, &cache_release);
+  if (pthread_create(&pid, NULL, &slab_trimmer, NULL) == 0) pthread_detach(pid);
+}
+
+// Gives the slab a cache index on first use
+static int slab_register(slab_t *slab)
+{
+  pthread_once(&slab_once, &slab_setup);
+
+  pthread_mutex_lock(&registry_lock);
+  if (slab->id < 0 && slab_count < SLAB_MAX) {
+    slabs[slab_count] = slab;
+    __atomic_store_n(&slab->id, slab_count, __ATOMIC_RELEASE);
+    __atomic_store_n(&slab_count, slab_count + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return slab->id;
+}
+
+// Returns the calling thread's cache for slab, NULL when there are too
+// many slabs and the object should come from malloc() directly
+static slab_cache_t *slab_cache(slab_t *slab)
+{
+  int id = __atomic_load_n(&slab->id, __ATOMIC_ACQUIRE);
+  if (id < 0) id = slab_register(slab);
+  if (id < 0) return NULL;
+
+  if (!cache_registered) {
+    // the value only needs to be non-NULL for the destructor to run
+    pthread_setspecific(cache_key, caches);
+    cache_registered = true;
+  }
+  return &caches[id];
+}
+
+static void slab_account(slab_t *slab, unsigned long *counter)
+{
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+  long in_use = __atomic_add_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&slab->peak, __ATOMIC_RELAXED);
+  while (in_use > peak &&
+         !__atomic_compare_exchange_n(&slab->peak, &peak, in_use, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void *slab_get(slab_t *slab)
+{
+  slab_cache_t *cache = slab_cache(slab);
+  if (NULL == cache) return malloc(slab->size);
+
+  if (NULL == cache->head) {
+    // refill half the cache in one go
+    pthread_mutex_lock(&slab->lock);
+    while (cache->count < SLAB_CACHE / 2 && NULL != slab->free_list) {
+      void *obj = slab->free_list;
+      slab->free_list = NEXT(obj);
+      slab->free_count--;
+      NEXT(obj) = cache->head;
+      cache->head = obj;
+      cache->count++;
+    }
+    pthread_mutex_unlock(&slab->lock);
+  }
+
+  void *obj = cache->head;
+  if (NULL != obj) {
+    cache->head = NEXT(obj);
+    cache->count--;
+    slab_account(slab, &slab->hits);
+    return obj;
+  }
+
+  // objects hold at least the free list link
+  obj = malloc(slab->size < sizeof(void *) ? sizeof(void *) : slab->size);
+  if (NULL != obj) slab_account(slab, &slab->misses);
+  return obj;
+}
+
+void slab_put(slab_t *slab, void *obj)
+{
+  if (NULL == obj) return;
+
+  slab_cache_t *cache = slab_cache(slab);
+  if (NULL == cache) {
+    free(obj);
+    return;
+  }
+  __atomic_sub_fetch(&slab->in_use, 1, __ATOMIC_RELAXED);
+
+  NEXT(obj) = cache->head;
+  cache->head = obj;
+  cache->count++;
+  if (cache->count > SLAB_CACHE) cache_spill(slab, cache, SLAB_CACHE / 2);
+}
+
+void slab_log_stats(int priority)
+{
+  int count = __atomic_load_n(&slab_count, __ATOMIC_ACQUIRE);
+
+  for (int id = 0; id < count; id++) {
+    slab_t *slab = slabs[id];
+    syslog(priority, "slab %s: %zu bytes, %ld in use, %zu shared free, "
+           "%lu hits, %lu misses, %lu trimmed", slab->name, slab->size,
+           __atomic_load_n(&slab->in_use, __ATOMIC_RELAXED), slab->free_count,
+           __atomic_load_n(&slab->hits, __ATOMIC_RELAXED),
+           __atomic_load_n(&slab->misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&slab->trimmed, __ATOMIC_RELAXED));
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef _SLAB__H_
+#define _SLAB__H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Pools of fixed size objects reused across connections. Every thread
+// keeps a few free objects of each slab it uses and only takes the slab
+// lock to refill or spill them in batches. Free objects beyond what the
+// last trim interval needed are released again.
+typedef struct slab_s slab_t;
+struct slab_s {
+  const char *name;
+  size_t size;
+  int id;                   // per-thread cache index, -1 until first use
+  pthread_mutex_t lock;
+  void *free_list;          // shared free objects, linked through their first word
+  size_t free_count;
+
+  // updated atomically
+  unsigned long hits;       // served from a free object
+  unsigned long misses;     // had to malloc()
+  unsigned long trimmed;    // released by the trimmer
+  long in_use;
+  long peak;                // highest in_use since the last trim
+};
+
+#define SLAB_INITIALIZER(name, size) \
+  { (name), (size), -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 }
+
+// Returns an uninitialized object of slab->size bytes, NULL when out of memory
+void *slab_get(slab_t *slab);
+void slab_put(slab_t *slab, void *obj);
+
+// Logs hits, misses and sizes of every slab in use
+void slab_log_stats(int priority);
+
+#endif
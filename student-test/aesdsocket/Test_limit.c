@@ -0,0 +1,178 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../server/aesdsocket.h"
+#include "../../server/metrics.h"
+
+#define MS 1000000ULL
+
+// aesdsocket_limit.c is linked without the server: it reads the limits
+// from this config, the time from the fake clock below and counts its
+// refusals here
+server_config_t config;
+static uint64_t fake_now = 1000 * MS;
+static uint64_t refused[COUNTER_COUNT];
+
+uint64_t metrics_now(void)
+{
+  return fake_now;
+}
+
+void metrics_add(enum metric_counter counter, uint64_t n)
+{
+  refused[counter] += n;
+}
+
+// Sets the limits and lets enough time pass for every bucket to be full
+static void limits(int client_conns, int client_lines, int client_bytes,
+                   int global_lines, int global_bytes)
+{
+  memset(&config, 0, sizeof(config));
+  config.client_conns = client_conns;
+  config.client_lines = client_lines;
+  config.client_bytes = client_bytes;
+  config.global_lines = global_lines;
+  config.global_bytes = global_bytes;
+  TEST_ASSERT_EQUAL_INT(0, limit_init());
+  memset(refused, 0, sizeof(refused));
+  fake_now += 3600 * 1000 * MS;
+}
+
+static int admitted_lines(in_addr_t addr, int tries, size_t len)
+{
+  int admitted = 0;
+  for (int i = 0; i < tries; i++) admitted += limit_line(addr, len);
+  return admitted;
+}
+
+/**
+* A full bucket holds one second of its rate, the line after that is
+* refused and counted.
+*/
+void test_limit_burst_then_refuse()
+{
+  limits(0, 10, 0, 0, 0);
+  TEST_ASSERT_EQUAL_INT(10, admitted_lines(1, 20, 8));
+  TEST_ASSERT_EQUAL_INT(10, refused[COUNTER_LIMITED_LINES]);
+
+  limits(2, 0, 0, 0, 0);
+  TEST_ASSERT_TRUE(limit_accept(1));
+  TEST_ASSERT_TRUE(limit_accept(1));
+  TEST_ASSERT_FALSE(limit_accept(1));
+  TEST_ASSERT_EQUAL_INT(1, refused[COUNTER_LIMITED_CONNS]);
+}
+
+/**
+* Tokens come back at the configured rate, never more than the burst.
+*/
+void test_limit_refill()
+{
+  limits(0, 10, 0, 0, 0);
+  TEST_ASSERT_EQUAL_INT(10, admitted_lines(1, 10, 8));
+  TEST_ASSERT_FALSE(limit_line(1, 8));
+
+  // 10 per second is one every 100ms
+  fake_now += 99 * MS;
+  TEST_ASSERT_FALSE(limit_line(1, 8));
+  fake_now += 1 * MS;
+  TEST_ASSERT_TRUE(limit_line(1, 8));
+  TEST_ASSERT_FALSE(limit_line(1, 8));
+
+  fake_now += 250 * MS;
+  TEST_ASSERT_EQUAL_INT(2, admitted_lines(1, 5, 8));
+
+  // idle far longer than a second still only refills the burst
+  fake_now += 60 * 1000 * MS;
+  TEST_ASSERT_EQUAL_INT(10, admitted_lines(1, 20, 8));
+}
+
+/**
+* Bytes are charged by length. A line longer than the burst still gets
+* through on a full bucket and leaves it empty for as long as it costs.
+*/
+void test_limit_bytes()
+{
+  limits(0, 0, 1000, 0, 0);
+  TEST_ASSERT_EQUAL_INT(10, admitted_lines(1, 20, 100));
+
+  fake_now += 3600 * 1000 * MS;
+  TEST_ASSERT_TRUE(limit_line(1, 5000));
+  fake_now += 4000 * MS;
+  TEST_ASSERT_FALSE(limit_line(1, 1));
+  fake_now += 1000 * MS;
+  TEST_ASSERT_TRUE(limit_line(1, 1));
+}
+
+/**
+* Lines far too long for n * 1e9 to fit in 64 bits still cost what they
+* should, the bucket stays empty instead of wrapping around to free.
+*/
+void test_limit_huge_line()
+{
+  // 20 GB at 1000 bytes per second, just past where the product wraps
+  limits(0, 0, 1000, 0, 0);
+  TEST_ASSERT_TRUE(limit_line(11, 20000000000ULL));
+  fake_now += 19999999ULL * 1000 * MS;
+  TEST_ASSERT_FALSE(limit_line(11, 1));
+  fake_now += 1000 * MS;
+  TEST_ASSERT_TRUE(limit_line(11, 1));
+
+  // saturates, the global bucket as well
+  limits(0, 0, 1000, 0, 1000);
+  TEST_ASSERT_TRUE(limit_line(12, (size_t) 1 << 62));
+  fake_now += 3600 * 1000 * MS;
+  TEST_ASSERT_FALSE(limit_line(12, 1));
+  TEST_ASSERT_FALSE(limit_line(13, 1));
+
+  // even that is over one day, the other tests find full buckets
+  fake_now += UINT64_MAX / 4;
+  TEST_ASSERT_TRUE(limit_line(12, 1));
+  TEST_ASSERT_TRUE(limit_line(13, 1));
+}
+
+/**
+* Every client address has its own buckets, the global ones are shared.
+*/
+void test_limit_clients_and_global()
+{
+  limits(0, 5, 0, 0, 0);
+  TEST_ASSERT_EQUAL_INT(5, admitted_lines(1, 10, 8));
+  TEST_ASSERT_EQUAL_INT(5, admitted_lines(2, 10, 8));
+
+  limits(0, 0, 0, 8, 0);
+  TEST_ASSERT_EQUAL_INT(5, admitted_lines(1, 5, 8));
+  TEST_ASSERT_EQUAL_INT(3, admitted_lines(2, 5, 8));
+}
+
+/**
+* A refused line costs nothing: neither the client's buckets when a
+* global one refuses, nor the global ones when the client's refuses.
+*/
+void test_limit_refusal_is_free()
+{
+  limits(0, 5, 0, 0, 300);
+  TEST_ASSERT_TRUE(limit_line(1, 250));
+  TEST_ASSERT_EQUAL_INT(0, admitted_lines(1, 10, 250));
+  TEST_ASSERT_EQUAL_INT(4, admitted_lines(1, 4, 1));
+
+  limits(0, 1, 0, 0, 300);
+  TEST_ASSERT_TRUE(limit_line(1, 1));
+  TEST_ASSERT_EQUAL_INT(0, admitted_lines(1, 10, 100));
+  TEST_ASSERT_TRUE(limit_line(2, 299));
+}
+
+/**
+* The client table is fixed: far more addresses than it has room for are
+* all served, the ones pushed out come back with full buckets.
+*/
+void test_limit_table_eviction()
+{
+  limits(0, 1, 0, 0, 0);
+  for (in_addr_t addr = 1; addr <= 100000; addr++) {
+    TEST_ASSERT_TRUE(limit_line(addr, 8));
+  }
+  TEST_ASSERT_EQUAL_INT(0, refused[COUNTER_LIMITED_LINES]);
+  // the latest clients are still known and empty
+  TEST_ASSERT_FALSE(limit_line(100000, 8));
+}
@@ -0,0 +1,163 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/line_parser.h"
+#include "../../server/aesdsocket.h"
+#include "../../server/aesd_log.h"
+
+// Receives data the way the servers do, straight into the parser buffer
+static void receive(line_parser_t *parser, const char *data, size_t len)
+{
+  size_t avail;
+  char *space = line_parser_space(parser, len, &avail);
+  TEST_ASSERT_NOT_NULL(space);
+  TEST_ASSERT_TRUE(avail >= len);
+  memcpy(space, data, len);
+  line_parser_commit(parser, len);
+}
+
+static void assert_next(line_parser_t *parser, const char *expected)
+{
+  size_t len;
+  const char *line = line_parser_next(parser, &len);
+  TEST_ASSERT_NOT_NULL_MESSAGE(line, "Expected another complete line");
+  TEST_ASSERT_EQUAL_INT(strlen(expected), len);
+  TEST_ASSERT_EQUAL_MEMORY(expected, line, len);
+}
+
+static void assert_pending(line_parser_t *parser, const char *expected)
+{
+  size_t len;
+  const char *partial = line_parser_pending(parser, &len);
+  TEST_ASSERT_EQUAL_INT(strlen(expected), len);
+  if (len > 0) TEST_ASSERT_EQUAL_MEMORY(expected, partial, len);
+}
+
+/**
+* Lines pipelined in one receive come out one by one and in order, with
+* nothing pending after the last \n.
+*/
+void test_line_parser_pipelined()
+{
+  line_parser_t parser;
+  size_t len;
+
+  line_parser_init(&parser);
+  receive(&parser, "first\nsecond\n\nAESDCHAR_IOCSEEKTO:1,2\n", 37);
+  assert_next(&parser, "first\n");
+  assert_next(&parser, "second\n");
+  assert_next(&parser, "\n");
+  assert_next(&parser, "AESDCHAR_IOCSEEKTO:1,2\n");
+  TEST_ASSERT_NULL(line_parser_next(&parser, &len));
+  assert_pending(&parser, "");
+  line_parser_free(&parser);
+}
+
+/**
+* A line split over several receives is only handed out once its \n
+* arrived, whatever follows it is kept for the next one.
+*/
+void test_line_parser_partial()
+{
+  line_parser_t parser;
+  size_t len;
+
+  line_parser_init(&parser);
+  receive(&parser, "hel", 3);
+  TEST_ASSERT_NULL(line_parser_next(&parser, &len));
+  assert_pending(&parser, "hel");
+  receive(&parser, "lo", 2);
+  TEST_ASSERT_NULL(line_parser_next(&parser, &len));
+  receive(&parser, "\nwor", 4);
+  assert_next(&parser, "hello\n");
+  TEST_ASSERT_NULL(line_parser_next(&parser, &len));
+  assert_pending(&parser, "wor");
+
+  // line_parser_feed copies the same way
+  TEST_ASSERT_EQUAL_INT(0, line_parser_feed(&parser, "ld\n", 3));
+  assert_next(&parser, "world\n");
+  assert_pending(&parser, "");
+  line_parser_free(&parser);
+}
+
+/**
+* A line many times the first buffer grows it and stays whole. pending
+* reports all of it, which is what the --max-line checks go by.
+*/
+void test_line_parser_long_line()
+{
+  const size_t long_len = 5 * LINE_PARSER_CHUNK + 17;
+  char *data = malloc(long_len + 1);
+  line_parser_t parser;
+  size_t len;
+
+  TEST_ASSERT_NOT_NULL(data);
+  for (size_t i = 0; i < long_len; i++) data[i] = 'a' + i % 26;
+  data[long_len] = '\n';
+
+  line_parser_init(&parser);
+  receive(&parser, "short\n", 6);
+  for (size_t sent = 0; sent < long_len; sent += 1000) {
+    receive(&parser, data + sent, (long_len - sent < 1000) ? long_len - sent : 1000);
+  }
+  assert_next(&parser, "short\n");
+  TEST_ASSERT_NULL(line_parser_next(&parser, &len));
+  line_parser_pending(&parser, &len);
+  TEST_ASSERT_EQUAL_INT(long_len, len);
+
+  receive(&parser, "\nnext", 5);
+  const char *line = line_parser_next(&parser, &len);
+  TEST_ASSERT_NOT_NULL(line);
+  TEST_ASSERT_EQUAL_INT(long_len + 1, len);
+  TEST_ASSERT_EQUAL_MEMORY(data, line, long_len + 1);
+  assert_pending(&parser, "next");
+
+  line_parser_free(&parser);
+  free(data);
+}
+
+/**
+* Commands are recognized by their prefix. A seek whose arguments aren't
+* two numbers is still a seek, to a command that doesn't exist, so it is
+* never appended to the log as data.
+*/
+void test_line_parser_commands()
+{
+  struct aesd_seekto seekto;
+  off_t from;
+  bool compress = false;
+
+#define LINE(s) s, strlen(s)
+  TEST_ASSERT_TRUE(parse_seekto(LINE("AESDCHAR_IOCSEEKTO:1,2\n"), &seekto));
+  TEST_ASSERT_EQUAL_INT(1, seekto.write_cmd);
+  TEST_ASSERT_EQUAL_INT(2, seekto.write_cmd_offset);
+
+  const char *malformed[] = {
+    "AESDCHAR_IOCSEEKTO:bad\n",
+    "AESDCHAR_IOCSEEKTO:1\n",
+    "AESDCHAR_IOCSEEKTO:\n",
+    "AESDCHAR_IOCSEEKTO:0,000000000000000000000000000000000000000001\n",
+  };
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+    seekto.write_cmd = 0;
+    TEST_ASSERT_TRUE(parse_seekto(LINE(malformed[i]), &seekto));
+    TEST_ASSERT_EQUAL_INT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, seekto.write_cmd);
+  }
+  TEST_ASSERT_FALSE(parse_seekto(LINE("AESDCHAR_IOCSEEK\n"), &seekto));
+  TEST_ASSERT_FALSE(parse_seekto(LINE("data AESDCHAR_IOCSEEKTO:1,2\n"), &seekto));
+
+  TEST_ASSERT_TRUE(parse_readfrom(LINE("AESDCHAR_READFROM:42\n"), &from));
+  TEST_ASSERT_EQUAL_INT(42, from);
+  TEST_ASSERT_FALSE(parse_readfrom(LINE("AESDCHAR_READFROM:-1\n"), &from));
+
+  TEST_ASSERT_TRUE(parse_compress(LINE("AESDCHAR_COMPRESS:lz4\n"), &compress));
+  TEST_ASSERT_TRUE(compress);
+  TEST_ASSERT_TRUE(parse_compress(LINE("AESDCHAR_COMPRESS:off"), &compress));
+  TEST_ASSERT_FALSE(compress);
+  TEST_ASSERT_FALSE(parse_compress(LINE("AESDCHAR_COMPRESS:zstd\n"), &compress));
+
+  TEST_ASSERT_TRUE(parse_subscribe(LINE("AESDCHAR_SUBSCRIBE\n")));
+  TEST_ASSERT_FALSE(parse_subscribe(LINE("AESDCHAR_SUBSCRIBE:now\n")));
+#undef LINE
+}
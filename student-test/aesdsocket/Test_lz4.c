@@ -0,0 +1,166 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/lz4.h"
+
+// Decoder for LZ4 blocks written from the format description
+// (lz4_Block_format.md), independent of server/lz4.c.
+// Returns the decoded length, -1 on malformed input.
+static long lz4_reference_decode(const unsigned char *src, size_t len, char *dst, size_t size)
+{
+  size_t in = 0, out = 0;
+
+  while (in < len) {
+    unsigned token = src[in++];
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      unsigned char more;
+      do {
+        if (in >= len) return -1;
+        more = src[in++];
+        literals += more;
+      } while (more == 255);
+    }
+    if (in + literals > len || out + literals > size) return -1;
+    memcpy(dst + out, src + in, literals);
+    in += literals;
+    out += literals;
+    // the last sequence has literals only
+    if (in == len) break;
+
+    if (in + 2 > len) return -1;
+    size_t offset = src[in] | (src[in + 1] << 8);
+    in += 2;
+    if (offset == 0 || offset > out) return -1;
+    size_t match = (token & 15) + 4;
+    if ((token & 15) == 15) {
+      unsigned char more;
+      do {
+        if (in >= len) return -1;
+        more = src[in++];
+        match += more;
+      } while (more == 255);
+    }
+    if (out + match > size) return -1;
+    // byte by byte, matches may overlap what they copy
+    for (size_t i = 0; i < match; i++, out++) dst[out] = dst[out - offset];
+  }
+  return out;
+}
+
+static void assert_round_trip(const char *src, size_t len)
+{
+  char *block = malloc(4 + LZ4_BOUND(len));
+  char *decoded = malloc(len + 1);
+  TEST_ASSERT_NOT_NULL(block);
+  TEST_ASSERT_NOT_NULL(decoded);
+
+  size_t n = lz4_compress_block(src, len, block);
+  TEST_ASSERT_TRUE(n <= LZ4_BOUND(len));
+  TEST_ASSERT_EQUAL_INT(len, lz4_reference_decode((unsigned char *) block, n, decoded, len));
+  if (len > 0) TEST_ASSERT_EQUAL_MEMORY(src, decoded, len);
+
+  // a frame block is the little endian size and the block, or the data
+  // as is when that is smaller
+  n = lz4_frame_block(src, len, block);
+  const unsigned char *b = (const unsigned char *) block;
+  uint32_t size = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+  TEST_ASSERT_EQUAL_INT(n, 4 + (size & ~LZ4_BLOCK_UNCOMPRESSED));
+  if (size & LZ4_BLOCK_UNCOMPRESSED) {
+    TEST_ASSERT_EQUAL_INT(len, n - 4);
+    if (len > 0) TEST_ASSERT_EQUAL_MEMORY(src, block + 4, len);
+  } else {
+    TEST_ASSERT_TRUE(n - 4 < len);
+    TEST_ASSERT_EQUAL_INT(len, lz4_reference_decode(b + 4, n - 4, decoded, len));
+    TEST_ASSERT_EQUAL_MEMORY(src, decoded, len);
+  }
+
+  free(block);
+  free(decoded);
+}
+
+/**
+* The test decoder itself reads a block made by the reference lz4
+* library (LZ4_compress_default) back to its input.
+*/
+void test_lz4_reference_block()
+{
+  static const unsigned char block[] = {
+    0xbf, 0x61, 0x65, 0x73, 0x64, 0x73, 0x6f, 0x63, 0x6b, 0x65, 0x74, 0x20, 0x0b, 0x00, 0x03,
+    0x71, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x31, 0x0a, 0x07, 0x00, 0x12, 0x32, 0x07, 0x00, 0x2f,
+    0x33, 0x0a, 0x2b, 0x00, 0x03, 0x07, 0x16, 0x00, 0x01, 0x2f, 0x00, 0x0f, 0x36, 0x00, 0x2e,
+    0x50, 0x6e, 0x65, 0x20, 0x33, 0x0a,
+  };
+  const char *line = "aesdsocket aesdsocket aesdsocket line 1\nline 2\nline 3\n";
+  char expected[256], decoded[256];
+
+  size_t len = 0;
+  for (int i = 0; i < 3; i++) {
+    memcpy(expected + len, line, strlen(line));
+    len += strlen(line);
+  }
+  TEST_ASSERT_EQUAL_INT(len, lz4_reference_decode(block, sizeof(block), decoded, sizeof(decoded)));
+  TEST_ASSERT_EQUAL_MEMORY(expected, decoded, len);
+}
+
+/**
+* Short inputs, log like text, runs and random bytes up to a whole block
+* decode to what was compressed.
+*/
+void test_lz4_round_trip()
+{
+  char *src = malloc(LZ4_BLOCK_MAX);
+  unsigned int seed = 7;
+  size_t len;
+
+  TEST_ASSERT_NOT_NULL(src);
+  for (len = 0; len < 70; len++) {
+    for (size_t i = 0; i < len; i++) src[i] = 'a' + i % 3;
+    assert_round_trip(src, len);
+  }
+
+  len = 0;
+  for (int i = 0; len + 64 < LZ4_BLOCK_MAX; i++) {
+    len += snprintf(src + len, 64, "2024-01-01 12:00:%02d line %d of the log\n", i % 60, i);
+  }
+  assert_round_trip(src, len);
+
+  memset(src, 'x', LZ4_BLOCK_MAX);
+  assert_round_trip(src, LZ4_BLOCK_MAX);
+
+  for (size_t i = 0; i < LZ4_BLOCK_MAX; i++) src[i] = rand_r(&seed);
+  assert_round_trip(src, LZ4_BLOCK_MAX);
+
+  // random with repeats up to 1000 bytes back
+  for (size_t i = 0; i < LZ4_BLOCK_MAX; i++) {
+    src[i] = (i > 1000 && rand_r(&seed) % 4) ? src[i - 1 - rand_r(&seed) % 1000] : rand_r(&seed) % 16;
+  }
+  assert_round_trip(src, LZ4_BLOCK_MAX);
+
+  free(src);
+}
+
+/**
+* Repetitive data has to get smaller, random data is stored as is.
+*/
+void test_lz4_frame_block_choice()
+{
+  char *src = malloc(LZ4_BLOCK_MAX);
+  char *block = malloc(4 + LZ4_BOUND(LZ4_BLOCK_MAX));
+  unsigned int seed = 11;
+
+  TEST_ASSERT_NOT_NULL(src);
+  TEST_ASSERT_NOT_NULL(block);
+  memset(src, '\n', LZ4_BLOCK_MAX);
+  TEST_ASSERT_TRUE(lz4_frame_block(src, LZ4_BLOCK_MAX, block) < LZ4_BLOCK_MAX / 100);
+
+  for (size_t i = 0; i < LZ4_BLOCK_MAX; i++) src[i] = rand_r(&seed);
+  TEST_ASSERT_EQUAL_INT(4 + LZ4_BLOCK_MAX, lz4_frame_block(src, LZ4_BLOCK_MAX, block));
+  TEST_ASSERT_TRUE(((unsigned char) block[3]) & 0x80);
+
+  free(src);
+  free(block);
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Regression test: clients that close their socket in the middle of a
+# large file backed reply must not take the server down (SIGPIPE from
+# sendfile). Run after building server/aesdsocket, uses port 9000 and
+# the data file of the file backend.
+cd "$(dirname "$0")/../../server"
+DATA=/var/tmp/aesdsocketdata
+line=$(head -c 1000000 /dev/zero | tr '\0' 'x')
+
+# Sends a line and reads only the first kilobyte of the reply. A
+# subshell, so a dead server only fails it; SIGPIPE is not ignored here,
+# the server would inherit that and the test would prove nothing.
+hang_up_early() {
+    (
+        exec 3<>/dev/tcp/127.0.0.1/9000 || exit 1
+        printf '%s\n' "$line" >&3
+        head -c 1000 <&3 >/dev/null
+    ) 2>/dev/null
+}
+
+for mode in pool threads; do
+    rm -f $DATA
+    ./aesdsocket -s file -m $mode -T 0 &
+    pid=$!
+    sleep 1
+
+    for i in 1 2 3 4 5; do
+        hang_up_early
+    done
+    sleep 0.5
+
+    if ! kill -0 $pid 2>/dev/null; then
+        wait $pid
+        echo "server in $mode mode died with status $?"
+        exit 1
+    fi
+    tail=$( (exec 3<>/dev/tcp/127.0.0.1/9000 && printf 'still here\n' >&3 && cat <&3) 2>/dev/null | tail -c 11)
+    kill $pid
+    wait $pid
+    if [ "$tail" != "still here" ]; then
+        echo "server in $mode mode did not answer after the early closes"
+        exit 1
+    fi
+    echo "$mode: ok"
+done
+rm -f $DATA